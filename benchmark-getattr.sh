@@ -0,0 +1,67 @@
+#! /bin/bash -eu
+
+# Measure getattr of deep paths and of missing paths with and without the path
+# index. Missing paths imitate Python imports which probe many candidates in
+# each directory of sys.path. The kernel does not cache misses, so every miss
+# reaches ros3fs.
+
+cd $(git rev-parse --show-toplevel)
+BUILD_DIR=$(pwd)/build_benchmark
+
+# Build ros3fs
+if [[ ! -d ${BUILD_DIR} ]]; then
+    mkdir ${BUILD_DIR}
+    ./build-aws-sdk-cpp.sh ${BUILD_DIR}
+    cmake -S . -B ${BUILD_DIR}
+    cmake --build ${BUILD_DIR} -- -j
+fi
+
+OZONE_OM_IP=$(sudo docker inspect --format='{{.NetworkSettings.Networks.bridge.Gateway}}' ozone-instance)
+MOUNTPOINT=${BUILD_DIR}/ros3fs_mountpoint
+CACHE_DIR=${BUILD_DIR}/ros3fs_cache_dir
+DEEP_DIR=deep/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15
+
+# Create 1000 files at depth 17
+aws configure set default.s3.signature_version s3v4
+aws configure set region us-west-1
+aws configure set aws_access_key_id "hoge"
+aws configure set aws_secret_access_key "fuga"
+aws s3api --endpoint http://${OZONE_OM_IP}:9878 create-bucket --bucket=bucket1 || true
+TMPDIR=$(mktemp -d)
+mkdir -p ${TMPDIR}/${DEEP_DIR}
+for i in $(seq 1 1000)
+do
+    echo ${RANDOM} > ${TMPDIR}/${DEEP_DIR}/${i}
+done
+aws s3 --endpoint http://${OZONE_OM_IP}:9878 cp --storage-class REDUCED_REDUNDANCY --recursive ${TMPDIR}/deep s3://bucket1/deep
+rm -rf ${TMPDIR}
+
+HIT_LIST=$(mktemp)
+MISS_LIST=$(mktemp)
+for i in $(seq 1 1000)
+do
+    echo ${MOUNTPOINT}/${DEEP_DIR}/${i} >> ${HIT_LIST}
+    for suffix in .py .pyc .so /__init__.py
+    do
+        echo ${MOUNTPOINT}/${DEEP_DIR}/module_${i}${suffix} >> ${MISS_LIST}
+    done
+done
+
+mkdir -p ${MOUNTPOINT}
+for opt in "" "--no_path_index"
+do
+    umount ${MOUNTPOINT} || true
+    ${BUILD_DIR}/ros3fs ${MOUNTPOINT} --endpoint=http://${OZONE_OM_IP}:9878 \
+        --bucket_name=bucket1/ --cache_dir=${CACHE_DIR} --update_seconds=3600 \
+        --clear_cache ${opt} > /dev/null 2>&1
+    sleep 5
+
+    echo "========== ros3fs ${opt} =========="
+    # The kernel caches hits after the first lookup, so measure them once.
+    echo "stat of 1000 deep paths"
+    time xargs -n 16 stat < ${HIT_LIST} > /dev/null
+    hyperfine --ignore-failure --style basic --warmup 3 --runs 10 \
+        "xargs -n 16 stat < ${MISS_LIST} > /dev/null 2>&1"
+done
+umount ${MOUNTPOINT} || true
+rm -f ${HIT_LIST} ${MISS_LIST}
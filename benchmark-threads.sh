@@ -0,0 +1,38 @@
+#! /bin/bash -eu
+
+# Measure how metadata and read throughput of ros3fs scale with the number of
+# FUSE worker threads. Run ./create-1000-files.sh before this script.
+
+cd $(git rev-parse --show-toplevel)
+BUILD_DIR=$(pwd)/build_benchmark
+
+# Build ros3fs
+if [[ ! -d ${BUILD_DIR} ]]; then
+    mkdir ${BUILD_DIR}
+    ./build-aws-sdk-cpp.sh ${BUILD_DIR}
+    cmake -S . -B ${BUILD_DIR}
+    cmake --build ${BUILD_DIR} -- -j
+fi
+
+OZONE_OM_IP=$(sudo docker inspect --format='{{.NetworkSettings.Networks.bridge.Gateway}}' ozone-instance)
+MOUNTPOINT=${BUILD_DIR}/ros3fs_mountpoint
+CACHE_DIR=${BUILD_DIR}/ros3fs_cache_dir
+
+mkdir -p ${MOUNTPOINT}
+for threads in 1 2 4 8 16 32 64
+do
+    umount ${MOUNTPOINT} || true
+    ${BUILD_DIR}/ros3fs ${MOUNTPOINT} --endpoint=http://${OZONE_OM_IP}:9878 \
+        --bucket_name=bucket1/ --cache_dir=${CACHE_DIR} --update_seconds=3600 \
+        --max_threads=${threads} --max_idle_threads=${threads} --clone_fd > /dev/null 2>&1
+    sleep 5
+
+    # Download all files to the cache directory before measuring.
+    find ${MOUNTPOINT} -type f | xargs cat > /dev/null
+
+    echo "========== ${threads} threads =========="
+    hyperfine --ignore-failure --style basic --warmup 3 --runs 10 \
+        "find ${MOUNTPOINT} -type f | xargs -n 16 -P ${threads} stat > /dev/null" \
+        "find ${MOUNTPOINT} -type f | xargs -n 16 -P ${threads} cat > /dev/null"
+done
+umount ${MOUNTPOINT} || true
@@ -50,6 +50,12 @@ aws s3 --endpoint http://${OZONE_OM_IP}:9878 ls s3://bucket1/
 
 rm -rf ${TMPDIR}
 
+# Create a large file for sequential read benchmarks
+TMPDIR=$(mktemp -d)
+dd if=/dev/urandom of=${TMPDIR}/large bs=1M count=256
+aws s3 --endpoint http://${OZONE_OM_IP}:9878 cp --storage-class REDUCED_REDUNDANCY ${TMPDIR}/large s3://bucket1/large/large
+rm -rf ${TMPDIR}
+
 function mount_FUSEs(){
     # Mount ros3fs
     if [[ ! -d ${BUILD_DIR}/ros3fs_mountpoint ]]; then
@@ -75,6 +81,17 @@ function mount_FUSEs(){
     ${BUILD_DIR}/mountpoint-s3/target/release/mount-s3  --endpoint-url=http://${OZONE_OM_IP}:9878 bucket1 ${BUILD_DIR}/mountpoint-s3_mountpoint > /dev/null 2>&1
 }
 
+# Mount only ros3fs with additional options
+function mount_ros3fs(){
+    if [[ ! -d ${BUILD_DIR}/ros3fs_mountpoint ]]; then
+        mkdir -p ${BUILD_DIR}/ros3fs_mountpoint
+    fi
+    umount ${BUILD_DIR}/ros3fs_mountpoint || true
+    rm -rf ${BUILD_DIR}/ros3fs_cache_dir || true
+    ${BUILD_DIR}/ros3fs ${BUILD_DIR}/ros3fs_mountpoint --endpoint=http://${OZONE_OM_IP}:9878 \
+        --bucket_name=bucket1/ --cache_dir=${BUILD_DIR}/ros3fs_cache_dir --update_seconds=100 --clear_cache "$@" > /dev/null 2>&1 &
+    sleep 5
+}
 
 mount_FUSEs
 echo "========== Compare grep performance without cache =========="
@@ -110,3 +127,14 @@ hyperfine --ignore-failure --style basic --warmup 3 --runs 10 "find ${BUILD_DIR}
 hyperfine --ignore-failure --style basic --warmup 3 --runs 10 "find ${BUILD_DIR}/s3fs-fuse_mountpoint"
 hyperfine --ignore-failure --style basic --warmup 3 --runs 10 "find ${BUILD_DIR}/mountpoint-s3_mountpoint"
 echo "========================================================="
+
+echo "========== Compare sequential read with and without splice =========="
+for opt in "" "--no_splice"
+do
+    mount_ros3fs ${opt}
+    # Download the file to the cache directory before measuring.
+    cat ${BUILD_DIR}/ros3fs_mountpoint/large/large > /dev/null
+    echo "ros3fs ${opt}"
+    hyperfine --ignore-failure --style basic --warmup 3 --runs 10 "dd if=${BUILD_DIR}/ros3fs_mountpoint/large/large of=/dev/null bs=1M"
+done
+echo "====================================================================="
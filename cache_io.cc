@@ -0,0 +1,308 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "cache_io.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+CacheIO::CacheIO(const bool use_io_uring) : use_io_uring_(false) {
+  for (size_t i = 0; i < kNumBuffers; i++) {
+    buffers_.emplace_back(new uint8_t[kBufferSize]);
+    free_buffers_.push_back(i);
+  }
+
+#ifdef ROS3FS_USE_IO_URING
+  if (use_io_uring) {
+    const int r = io_uring_queue_init(kQueueDepth, &ring_, 0);
+    if (r < 0) {
+      LOG(WARNING) << "io_uring is unavailable. Fall back to pread/pwrite: "
+                   << strerror(-r);
+    } else {
+      use_io_uring_ = true;
+
+      std::vector<struct iovec> iovecs;
+      for (const auto &b : buffers_) {
+        iovecs.emplace_back(iovec{.iov_base = b.get(), .iov_len = kBufferSize});
+      }
+      buffers_registered_ =
+          io_uring_register_buffers(&ring_, iovecs.data(), iovecs.size()) == 0;
+      LOG_IF(WARNING, !buffers_registered_)
+          << "Failed to register buffers to io_uring.";
+
+      // Register empty slots and fill them when files are opened.
+      const std::vector<int> fds(kMaxFixedFiles, -1);
+      files_registered_ =
+          io_uring_register_files(&ring_, fds.data(), fds.size()) == 0;
+      LOG_IF(WARNING, !files_registered_)
+          << "Failed to register files to io_uring.";
+      if (files_registered_) {
+        for (int i = kMaxFixedFiles - 1; i >= 0; i--) {
+          free_fixed_files_.push_back(i);
+        }
+      }
+
+      submit_thread_ = std::thread(&CacheIO::SubmitLoop, this);
+      reap_thread_ = std::thread(&CacheIO::ReapLoop, this);
+    }
+  }
+#else
+  LOG_IF(WARNING, use_io_uring)
+      << "ros3fs is built without io_uring. Fall back to pread/pwrite.";
+#endif
+  LOG(INFO) << "CacheIO initialized with " << LOG_KEY(use_io_uring_);
+}
+
+CacheIO::~CacheIO() {
+#ifdef ROS3FS_USE_IO_URING
+  if (use_io_uring_) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    submit_thread_.join();
+
+    // Wake up ReapLoop with a request without data.
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+    CHECK(sqe != nullptr);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(&ring_);
+    reap_thread_.join();
+
+    io_uring_queue_exit(&ring_);
+  }
+#endif
+}
+
+ssize_t CacheIO::Read(int fd, void *buf, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t r = Submit(Op::kRead, fd, static_cast<uint8_t *>(buf) + done,
+                             size - done, offset + done, -1);
+    if (r == -EINTR || r == -EAGAIN) {
+      continue;
+    }
+    if (r < 0) {
+      return r;
+    }
+    if (r == 0) {
+      break;
+    }
+    done += r;
+  }
+  return done;
+}
+
+ssize_t CacheIO::Write(int fd, const Buffer &buffer, size_t size,
+                       off_t offset) {
+  CHECK_LE(size, buffer.capacity);
+
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t r = Submit(Op::kWrite, fd, buffer.data + done, size - done,
+                             offset + done, buffer.index);
+    if (r == -EINTR || r == -EAGAIN) {
+      continue;
+    }
+    if (r < 0) {
+      return r;
+    }
+    done += r;
+  }
+  return done;
+}
+
+int CacheIO::Fsync(int fd) {
+  return Submit(Op::kFsync, fd, nullptr, 0, 0, -1);
+}
+
+CacheIO::Buffer CacheIO::AcquireBuffer() {
+  std::unique_lock<std::mutex> lock(buffers_mutex_);
+  buffers_cv_.wait(lock, [this] { return !free_buffers_.empty(); });
+  const int index = free_buffers_.back();
+  free_buffers_.pop_back();
+  return Buffer{.index = index,
+                .data = buffers_[index].get(),
+                .capacity = kBufferSize};
+}
+
+void CacheIO::ReleaseBuffer(const Buffer &buffer) {
+  {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    free_buffers_.push_back(buffer.index);
+  }
+  buffers_cv_.notify_one();
+}
+
+void CacheIO::RegisterFile(int fd) {
+#ifdef ROS3FS_USE_IO_URING
+  if (!use_io_uring_ || !files_registered_) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_fixed_files_.empty() || fixed_files_.contains(fd)) {
+    return;
+  }
+  const int slot = free_fixed_files_.back();
+  if (io_uring_register_files_update(&ring_, slot, &fd, 1) < 0) {
+    LOG(WARNING) << "Failed to register " << LOG_KEY(fd) << " to io_uring.";
+    return;
+  }
+  free_fixed_files_.pop_back();
+  fixed_files_[fd] = slot;
+#else
+  (void)fd;
+#endif
+}
+
+void CacheIO::UnregisterFile(int fd) {
+#ifdef ROS3FS_USE_IO_URING
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = fixed_files_.find(fd);
+  if (it == fixed_files_.end()) {
+    return;
+  }
+  const int empty = -1;
+  io_uring_register_files_update(&ring_, it->second, &empty, 1);
+  free_fixed_files_.push_back(it->second);
+  fixed_files_.erase(it);
+#else
+  (void)fd;
+#endif
+}
+
+ssize_t CacheIO::Submit(const Op op, const int fd, void *buf, const size_t size,
+                        const off_t offset, const int buf_index) {
+#ifdef ROS3FS_USE_IO_URING
+  if (use_io_uring_) {
+    Request request{.op = op,
+                    .fd = fd,
+                    .buf = buf,
+                    .size = size,
+                    .offset = offset,
+                    .buf_index = buffers_registered_ ? buf_index : -1,
+                    .result = {}};
+    std::future<ssize_t> result = request.result.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(&request);
+    }
+    cv_.notify_all();
+    return result.get();
+  }
+#else
+  (void)buf_index;
+#endif
+  return SubmitSync(op, fd, buf, size, offset);
+}
+
+ssize_t CacheIO::SubmitSync(const Op op, const int fd, void *buf,
+                            const size_t size, const off_t offset) {
+  ssize_t r = 0;
+  switch (op) {
+  case Op::kRead:
+    r = pread(fd, buf, size, offset);
+    break;
+  case Op::kWrite:
+    r = pwrite(fd, buf, size, offset);
+    break;
+  case Op::kFsync:
+    r = fsync(fd);
+    break;
+  }
+  return r < 0 ? -errno : r;
+}
+
+#ifdef ROS3FS_USE_IO_URING
+// Moves all pending requests to the submission queue and submits them with
+// one io_uring_submit call.
+void CacheIO::SubmitLoop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] {
+        return stop_ || (!pending_.empty() && inflight_ < kQueueDepth);
+      });
+      if (stop_ && pending_.empty()) {
+        break;
+      }
+
+      const size_t n = std::min(pending_.size(), kQueueDepth - inflight_);
+      for (size_t i = 0; i < n; i++) {
+        Request *request = pending_[i];
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+        CHECK(sqe != nullptr);
+
+        int fd = request->fd;
+        const auto it = fixed_files_.find(fd);
+        if (it != fixed_files_.end()) {
+          fd = it->second;
+        }
+
+        switch (request->op) {
+        case Op::kRead:
+          io_uring_prep_read(sqe, fd, request->buf, request->size,
+                             request->offset);
+          break;
+        case Op::kWrite:
+          if (request->buf_index >= 0) {
+            io_uring_prep_write_fixed(sqe, fd, request->buf, request->size,
+                                      request->offset, request->buf_index);
+          } else {
+            io_uring_prep_write(sqe, fd, request->buf, request->size,
+                                request->offset);
+          }
+          break;
+        case Op::kFsync:
+          io_uring_prep_fsync(sqe, fd, 0);
+          break;
+        }
+        if (it != fixed_files_.end()) {
+          io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+        }
+        io_uring_sqe_set_data(sqe, request);
+      }
+      pending_.erase(pending_.begin(), pending_.begin() + n);
+      inflight_ += n;
+      VLOG(3) << "Submit " << n << " requests to io_uring";
+    }
+
+    int r = 0;
+    do {
+      r = io_uring_submit(&ring_);
+    } while (r == -EINTR || r == -EAGAIN);
+    CHECK_GE(r, 0) << "io_uring_submit failed: " << strerror(-r);
+  }
+}
+
+void CacheIO::ReapLoop() {
+  while (true) {
+    struct io_uring_cqe *cqe = nullptr;
+    const int r = io_uring_wait_cqe(&ring_, &cqe);
+    if (r == -EINTR) {
+      continue;
+    }
+    CHECK_EQ(r, 0) << "io_uring_wait_cqe failed: " << strerror(-r);
+
+    Request *request = static_cast<Request *>(io_uring_cqe_get_data(cqe));
+    const int res = cqe->res;
+    io_uring_cqe_seen(&ring_, cqe);
+    if (request == nullptr) {
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      inflight_--;
+    }
+    cv_.notify_all();
+    request->result.set_value(res);
+  }
+}
+#endif
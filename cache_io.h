@@ -0,0 +1,110 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef ROS3FS_USE_IO_URING
+#include <liburing.h>
+#endif
+
+// I/O layer for cache files. When io_uring is available, requests from all
+// FUSE threads are batched into one submission queue, buffers used for
+// downloaded blocks are registered, and files opened for reading are
+// registered as fixed files. Otherwise it falls back to pread/pwrite/fsync
+// in the calling thread.
+//
+// All functions return the number of bytes processed or -errno.
+class CacheIO {
+public:
+  // A buffer from the registered buffer pool.
+  struct Buffer {
+    int index;
+    uint8_t *data;
+    size_t capacity;
+  };
+
+  static constexpr size_t kBufferSize = 1 << 20;
+  static constexpr size_t kNumBuffers = 16;
+
+  explicit CacheIO(const bool use_io_uring);
+  ~CacheIO();
+  CacheIO(CacheIO const &) = delete;
+  void operator=(CacheIO const &) = delete;
+
+  bool use_io_uring() const { return use_io_uring_; }
+
+  // Reads until `size` bytes are read or EOF.
+  ssize_t Read(int fd, void *buf, size_t size, off_t offset);
+  // Writes the first `size` bytes of `buffer`.
+  ssize_t Write(int fd, const Buffer &buffer, size_t size, off_t offset);
+  int Fsync(int fd);
+
+  // Blocks until a buffer is available.
+  Buffer AcquireBuffer();
+  void ReleaseBuffer(const Buffer &buffer);
+
+  // Registered files are referred by their index in the fixed file table.
+  void RegisterFile(int fd);
+  void UnregisterFile(int fd);
+
+private:
+  enum class Op { kRead, kWrite, kFsync };
+
+  struct Request {
+    Op op;
+    int fd;
+    void *buf;
+    size_t size;
+    off_t offset;
+    // Index in the registered buffers or -1.
+    int buf_index;
+    std::promise<ssize_t> result;
+  };
+
+  ssize_t Submit(const Op op, const int fd, void *buf, const size_t size,
+                 const off_t offset, const int buf_index);
+  ssize_t SubmitSync(const Op op, const int fd, void *buf, const size_t size,
+                     const off_t offset);
+
+  bool use_io_uring_;
+
+  std::mutex buffers_mutex_;
+  std::condition_variable buffers_cv_;
+  std::vector<std::unique_ptr<uint8_t[]>> buffers_;
+  std::vector<int> free_buffers_;
+
+#ifdef ROS3FS_USE_IO_URING
+  static constexpr unsigned kQueueDepth = 256;
+  static constexpr unsigned kMaxFixedFiles = 1024;
+
+  void SubmitLoop();
+  void ReapLoop();
+
+  struct io_uring ring_;
+  bool buffers_registered_ = false;
+  bool files_registered_ = false;
+
+  // You must get mutex_ before accessing the members below.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Request *> pending_;
+  size_t inflight_ = 0;
+  bool stop_ = false;
+  std::unordered_map<int, int> fixed_files_;
+  std::vector<int> free_fixed_files_;
+
+  std::thread submit_thread_;
+  std::thread reap_thread_;
+#endif
+};
@@ -5,6 +5,8 @@
 #include "glog/logging.h"
 
 #include <cstddef>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <memory>
 #include <nlohmann/json.hpp>
@@ -17,290 +19,1628 @@
 #include <aws/s3/model/ListObjectsRequest.h>
 
 #include <optional>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "sha256.h"
+#include "xxh3.h"
 
 namespace {
 
-std::string
-SerializeObjectMetaData(const std::vector<ObjectMetaData> &meta_datas) {
+// A packed object is fetched in one GET and held in memory until it is
+// appended, and it cannot be read before the whole object arrives. Larger
+// objects are streamed to their own cache files instead.
+constexpr uint64_t kMaxPackThreshold = 1 << 20;
+
+// One line of the lazy listing journal.
+std::string SerializeListing(const std::filesystem::path &path,
+                             const std::vector<std::string> &directories,
+                             const std::vector<FileMetaData> &files) {
   nlohmann::json j;
-  for (const auto &md : meta_datas) {
+  j["path"] = path;
+  j["directories"] = directories;
+  j["files"] = nlohmann::json::array();
+  for (const auto &f : files) {
     nlohmann::json j2;
-    j2["path"] = md.path;
-    j2["size"] = md.size;
-    j2["unix_time_millis"] = md.unix_time_millis;
-    j.push_back(j2);
+    j2["name"] = f.name;
+    j2["size"] = f.size;
+    j2["unix_time_millis"] = f.unix_time_millis;
+    j["files"].push_back(j2);
   }
   return j.dump();
 }
 
-std::vector<ObjectMetaData> DeserializeObjectMetaData(const std::string &json) {
-  std::vector<ObjectMetaData> meta_datas;
-  nlohmann::json j = nlohmann::json::parse(json);
-  for (const auto &j2 : j) {
-    ObjectMetaData md;
-    md.path = std::filesystem::path(j2["path"]);
-    md.size = j2["size"];
-    md.unix_time_millis = j2["unix_time_millis"];
-    meta_datas.push_back(md);
+// Appends paths of all files under `node` to `files`.
+void CollectFiles(const std::shared_ptr<Directory> &node,
+                  const std::filesystem::path &path,
+                  std::vector<std::filesystem::path> *files) {
+  if (node->self.type == FileType::kFile) {
+    files->emplace_back(path);
+    return;
+  }
+  for (const auto &child : node->directories) {
+    CollectFiles(child.second, path / child.first, files);
+  }
+}
+
+// Removes children of `dir` which are not marked with `generation`, updates
+// times of directories and returns the oldest time under `dir`.
+int64_t SweepDirectory(const std::shared_ptr<Directory> &dir,
+                       const std::filesystem::path &path,
+                       const uint64_t generation,
+                       std::vector<std::filesystem::path> *stale_objects) {
+  int64_t oldest = INT64_MAX;
+  for (auto it = dir->directories.begin(); it != dir->directories.end();) {
+    const std::shared_ptr<Directory> child = it->second;
+    if (child->generation != generation) {
+      CollectFiles(child, path / it->first, stale_objects);
+      it = dir->directories.erase(it);
+      continue;
+    }
+    if (child->self.type == FileType::kDirectory) {
+      const int64_t t =
+          SweepDirectory(child, path / it->first, generation, stale_objects);
+      if (t != INT64_MAX) {
+        child->self.unix_time_millis = t;
+      }
+    }
+    oldest = std::min(oldest, child->self.unix_time_millis);
+    ++it;
+  }
+  return oldest;
+}
+
+// Returns the directory part of a key or a prefix in the change log such as
+// "dir/sub/" for "dir/sub/file". Keys at the top level give "".
+std::string DirectoryPrefix(std::string key) {
+  while (!key.empty() && (key.back() == '\r' || key.back() == ' ')) {
+    key.pop_back();
+  }
+  const size_t start = key.find_first_not_of('/');
+  if (start == std::string::npos) {
+    return "";
+  }
+  const size_t slash = key.rfind('/');
+  return slash == std::string::npos || slash < start
+             ? ""
+             : key.substr(start, slash + 1 - start);
+}
+
+// Sets the modification time of the cache file `fd` to that of its object
+// for IsCurrentCacheFile. Returns 0 or -errno.
+int StampCacheFile(const int fd, const FileMetaData &meta) {
+  const struct timespec times[2] = {
+      {.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+      {.tv_sec = meta.unix_time_millis / 1000,
+       .tv_nsec = meta.unix_time_millis % 1000 * 1000000}};
+  return futimens(fd, times) == 0 ? 0 : -errno;
+}
+
+// Cache files have the modification times of their objects. Returns true when
+// `cache_file` holds the version of the object described by `meta`. A cache
+// file which is not removed yet after a refresh is not current.
+bool IsCurrentCacheFile(const std::filesystem::path &cache_file,
+                        const FileMetaData &meta) {
+  struct stat st;
+  if (stat(cache_file.c_str(), &st) != 0) {
+    return false;
+  }
+  const int64_t unix_time_millis =
+      int64_t(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+  return static_cast<uint64_t>(st.st_size) == meta.size &&
+         unix_time_millis == meta.unix_time_millis;
+}
+
+// A file compared by SampleDiffers.
+struct SampleEntry {
+  std::string key;
+  uint64_t size;
+  int64_t unix_time_millis;
+  auto operator<=>(const SampleEntry &) const = default;
+};
+
+// Appends files under `dir`, whose keys start with `base` such as "top/sub/",
+// with keys in (low, high] to `entries`. No upper bound when `high` is
+// std::nullopt. Stops once `entries` has `limit` files. Subtrees which cannot
+// have such keys are skipped.
+void CollectKeyRange(const std::shared_ptr<Directory> &dir,
+                     const std::string &base, const std::string &low,
+                     const std::optional<std::string> &high,
+                     const size_t limit, std::vector<SampleEntry> *entries) {
+  const auto visit = [&](const std::string &name,
+                         const std::shared_ptr<Directory> &child) {
+    if (entries->size() >= limit) {
+      return;
+    }
+    if (child->self.type == FileType::kFile) {
+      const std::string key = base + name;
+      if (key > low && (!high.has_value() || key <= *high)) {
+        entries->emplace_back(SampleEntry{.key = key,
+                                          .size = child->self.size,
+                                          .unix_time_millis =
+                                              child->self.unix_time_millis});
+      }
+      return;
+    }
+    // Keys under the child start with `key`.
+    const std::string key = base + name + "/";
+    if ((key > low || low.starts_with(key)) &&
+        (!high.has_value() || key <= *high)) {
+      CollectKeyRange(child, key, low, high, limit, entries);
+    }
+  };
+
+  // Names of children in the key range start from the name in `low` and end
+  // at the name in `high`.
+  const auto name_in = [&](const std::string &key) {
+    const size_t slash = key.find('/', base.size());
+    return key.substr(base.size(), slash == std::string::npos
+                                       ? std::string::npos
+                                       : slash - base.size());
+  };
+  auto it = dir->directories.begin();
+  if (low.starts_with(base)) {
+    const std::string first = name_in(low);
+    // "a/" of a directory "a" sorts after "a.b" although "a" sorts before.
+    for (size_t n = 1; n < first.size(); n++) {
+      const auto p = dir->directories.find(first.substr(0, n));
+      if (p != dir->directories.end()) {
+        visit(p->first, p->second);
+      }
+    }
+    it = dir->directories.lower_bound(first);
   }
-  return meta_datas;
+  const std::optional<std::string> last =
+      high.has_value() && high->starts_with(base)
+          ? std::make_optional(name_in(*high))
+          : std::nullopt;
+  for (; it != dir->directories.end() && entries->size() < limit; ++it) {
+    if (last.has_value() && it->first > *last &&
+        !it->first.starts_with(*last)) {
+      break;
+    }
+    visit(it->first, it->second);
+  }
+}
+
+std::shared_ptr<Directory> MakeUnlistedRoot() {
+  return std::make_shared<Directory>(
+      Directory{.self = FileMetaData{.name = "/",
+                                     .size = 0,
+                                     .type = FileType::kDirectory,
+                                     .unix_time_millis = 0},
+                .listed = false});
 }
 
 } // namespace
 
-std::vector<uint8_t>
-ROS3FSContext::GetFileContents(const std::filesystem::path &path) {
-  std::filesystem::path cache_file =
-      cache_dir() / ("ros3fs_cache_file_" + GetSHA256(path.string()));
+// Cache files are sharded into two levels of directories such as
+// cache_dir/ab/cd/abcd... to keep each directory small.
+std::filesystem::path
+ROS3FSContext::CacheFilePath(const std::filesystem::path &path) const {
+  const std::string key = GetXXH3(path.string());
+  return cache_dir_ / key.substr(0, 2) / key.substr(2, 2) / key;
+}
 
-  if (!std::filesystem::exists(cache_file)) {
-    Aws::Client::ClientConfiguration config;
-    config.endpointOverride = endpoint_;
-    Aws::S3::S3Client client(config);
+// Downloads `path` to `fd` in ranges and raises download.watermark as each
+// buffer is written. The first range is small so that readers of the head of
+// the object do not wait for a whole range, and ranges double up to
+// range_size_. Returns 0 or -errno.
+int ROS3FSContext::DownloadToCache(const std::filesystem::path &path,
+                                   const FileMetaData &meta, const int fd,
+                                   Download &download) {
+  constexpr uint64_t kFirstRangeSize = 256 << 10;
+  const CacheIO::Buffer buffer = cache_io_->AcquireBuffer();
+  std::vector<uint8_t> data;
+  // Later ranges must come from the same version as the first one.
+  std::string etag;
+  ssize_t r = 0;
+  uint64_t range = std::min(kFirstRangeSize, range_size_);
+  for (uint64_t offset = 0; offset < meta.size && r >= 0; offset += range,
+                range = std::min(range * 2, range_size_)) {
+    if (downloads_stop_) {
+      r = -ECANCELED;
+      break;
+    }
+    r = s3_->GetRange(bucket_name_, path.string().substr(1), offset,
+                      std::min(range, meta.size - offset), &data, &etag);
+    for (size_t done = 0; done < data.size() && r >= 0;
+         done += buffer.capacity) {
+      const size_t n = std::min(buffer.capacity, data.size() - done);
+      memcpy(buffer.data, data.data() + done, n);
+      r = cache_io_->Write(fd, buffer, n, offset + done);
+      if (r >= 0) {
+        std::lock_guard<std::mutex> lock(download.mutex);
+        download.watermark = offset + done + n;
+        download.cv.notify_all();
+      }
+    }
+  }
+  cache_io_->ReleaseBuffer(buffer);
+  if (r >= 0) {
+    r = cache_io_->Fsync(fd);
+  }
+  return r < 0 ? r : 0;
+}
 
-    Aws::S3::Model::GetObjectRequest request;
-    request.SetBucket(bucket_name_);
-    request.SetKey(path.string().substr(1));
+// Runs in a detached thread started by OpenCacheFile. Renames the temporary
+// file to `cache_file` when the download completes and removes `download`
+// from downloads_. An abandoned download leaves both alone because they may
+// belong to a newer download of the object by now.
+void ROS3FSContext::RunDownload(const std::filesystem::path path,
+                                const FileMetaData meta,
+                                const std::filesystem::path cache_file,
+                                const int fd,
+                                const std::shared_ptr<Download> download) {
+  int r = DownloadToCache(path, meta, fd, *download);
+  if (r >= 0) {
+    r = StampCacheFile(fd, meta);
+  }
+  close(fd);
+  if (r < 0) {
+    LOG(ERROR) << "Failed to download " << path << " to "
+               << download->tmp_file << ": " << strerror(-r);
+  }
 
-    Aws::S3::Model::GetObjectOutcome outcome = client.GetObject(request);
+  // Critical section start
+  std::lock_guard<std::mutex> downloads_lock(downloads_mutex_);
+  if (!download->abandoned) {
+    std::lock_guard<std::mutex> cache_lock(cache_file_mutex_);
+    std::error_code ec;
+    if (r >= 0) {
+      std::filesystem::rename(download->tmp_file, cache_file, ec);
+      LOG_IF(ERROR, ec) << "Failed to rename " << download->tmp_file << " to "
+                        << cache_file << ": " << ec.message();
+    }
+    if (r < 0 || ec) {
+      // Files opened by readers stay readable up to the watermark.
+      std::filesystem::remove(download->tmp_file, ec);
+    }
+    downloads_.erase(cache_file.string());
+  }
+  {
+    std::lock_guard<std::mutex> lock(download->mutex);
+    download->error = r;
+    download->done = true;
+    download->cv.notify_all();
+  }
+  running_downloads_--;
+  downloads_cv_.notify_all();
+  // Critical section end
+}
 
-    if (outcome.IsSuccess()) {
-      LOG(INFO) << "Successfully retrieved '" << path.string().substr(1)
-                << "' from '"
-                << "bucket1/"
-                << "'." << std::endl;
-      {
-        std::lock_guard<std::mutex> lock(cache_file_mutex_);
-        std::ofstream ofs(cache_file);
-        ofs << outcome.GetResult().GetBody().rdbuf();
+// Cautions: This function is not thread safe. Call this with downloads_mutex_
+// and cache_file_mutex_ held before removing `cache_file` so that its download
+// in progress, if any, does not put the old version back.
+void ROS3FSContext::AbandonDownloadLocked(
+    const std::filesystem::path &cache_file) {
+  const auto it = downloads_.find(cache_file.string());
+  if (it == downloads_.end()) {
+    return;
+  }
+  LOG(INFO) << "Abandon the download to " << cache_file;
+  it->second->abandoned = true;
+  // The next download of the object creates a file with the same name.
+  if (!it->second->tmp_file.empty()) {
+    std::error_code ec;
+    std::filesystem::remove(it->second->tmp_file, ec);
+  }
+  downloads_.erase(it);
+}
+
+// Downloads a small object `path` and appends it to a pack segment. Like
+// downloads to cache files, the download is registered in downloads_ under
+// `cache_file` so that concurrent opens of the object wait for it instead of
+// appending duplicate records. Returns 0 or -errno.
+int ROS3FSContext::DownloadToPack(const std::filesystem::path &path,
+                                  const std::filesystem::path &cache_file,
+                                  const FileMetaData &meta) {
+  std::shared_ptr<Download> download;
+  bool running = false;
+  {
+    // Critical section start
+    std::lock_guard<std::mutex> downloads_lock(downloads_mutex_);
+    auto it = downloads_.find(cache_file.string());
+    if (it != downloads_.end() &&
+        (it->second->size != meta.size ||
+         it->second->unix_time_millis != meta.unix_time_millis)) {
+      // The object changed since the download started.
+      std::lock_guard<std::mutex> cache_lock(cache_file_mutex_);
+      AbandonDownloadLocked(cache_file);
+      it = downloads_.end();
+    }
+    running = it != downloads_.end();
+    if (running) {
+      download = it->second;
+    } else {
+      download = std::make_shared<Download>();
+      download->size = meta.size;
+      download->unix_time_millis = meta.unix_time_millis;
+      downloads_[cache_file.string()] = download;
+    }
+    // Critical section end
+  }
+  if (running) {
+    std::unique_lock<std::mutex> lock(download->mutex);
+    download->cv.wait(lock, [&] { return download->done; });
+    return download->error;
+  }
+
+  std::vector<uint8_t> data;
+  std::string etag;
+  int r = s3_->GetRange(bucket_name_, path.string().substr(1), 0, meta.size,
+                        &data, &etag);
+  if (r >= 0) {
+    r = pack_store_->Append(path.string(), meta.unix_time_millis, data.data(),
+                            data.size());
+  }
+
+  // Critical section start
+  std::lock_guard<std::mutex> downloads_lock(downloads_mutex_);
+  if (!download->abandoned) {
+    downloads_.erase(cache_file.string());
+  }
+  std::lock_guard<std::mutex> lock(download->mutex);
+  download->error = r;
+  download->done = true;
+  download->cv.notify_all();
+  // Critical section end
+  return r;
+}
+
+int ROS3FSContext::OpenPackedFile(OpenedFile &file, const FileMetaData &meta) {
+  std::optional<PackStore::Location> location =
+      pack_store_->Find(file.path.string(), meta.size, meta.unix_time_millis);
+  if (!location.has_value()) {
+    const int r = DownloadToPack(file.path, file.cache_file, meta);
+    if (r < 0) {
+      return r;
+    }
+    location =
+        pack_store_->Find(file.path.string(), meta.size, meta.unix_time_millis);
+    if (!location.has_value()) {
+      LOG(ERROR) << "Size of " << file.path << " differs from its metadata.";
+      return -EIO;
+    }
+  }
+
+  file.segment = location->segment;
+  file.base = location->offset;
+  file.size = location->size;
+  file.fd = file.segment->fd;
+  return file.fd;
+}
+
+int ROS3FSContext::OpenCacheFile(OpenedFile &file) {
+  std::lock_guard<std::mutex> lock(file.mutex);
+  if (file.fd < 0) {
+    FileMetaData meta;
+    const int err = GetAttr(file.path, &meta);
+    if (err < 0) {
+      return err;
+    }
+    if (meta.type != FileType::kFile) {
+      return -EISDIR;
+    }
+    if (pack_store_ != nullptr && meta.size <= pack_threshold_) {
+      return OpenPackedFile(file, meta);
+    }
+
+    // Critical section start
+    std::lock_guard<std::mutex> downloads_lock(downloads_mutex_);
+    auto it = downloads_.find(file.cache_file.string());
+    if (it != downloads_.end() &&
+        (it->second->size != meta.size ||
+         it->second->unix_time_millis != meta.unix_time_millis)) {
+      // The object changed since the download started.
+      std::lock_guard<std::mutex> cache_lock(cache_file_mutex_);
+      AbandonDownloadLocked(file.cache_file);
+      it = downloads_.end();
+    }
+    if (it != downloads_.end()) {
+      file.download = it->second;
+    } else if (!IsCurrentCacheFile(file.cache_file, meta)) {
+      // Download in background so that reads return as soon as their range
+      // arrives. The download replaces a stale cache file when it completes.
+      auto download = std::make_shared<Download>();
+      download->tmp_file = file.cache_file.string() + ".tmp";
+      download->size = meta.size;
+      download->unix_time_millis = meta.unix_time_millis;
+      std::filesystem::create_directories(file.cache_file.parent_path());
+      const int fd =
+          open(download->tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        const int err = errno;
+        PLOG(ERROR) << "Failed to open " << download->tmp_file;
+        return -err;
       }
+      downloads_[file.cache_file.string()] = download;
+      running_downloads_++;
+      std::thread(&ROS3FSContext::RunDownload, this, file.path, meta,
+                  file.cache_file, fd, download)
+          .detach();
+      file.download = download;
+    }
+
+    const std::filesystem::path &p =
+        file.download != nullptr ? file.download->tmp_file : file.cache_file;
+    std::lock_guard<std::mutex> cache_lock(cache_file_mutex_);
+    file.fd = open(p.c_str(), O_RDONLY);
+    if (file.fd < 0) {
+      const int err = errno;
+      PLOG(ERROR) << "Failed to open " << p;
+      file.download.reset();
+      return -err;
+    }
+    cache_io_->RegisterFile(file.fd);
+    // Critical section end
+  }
+  return file.fd;
+}
+
+ssize_t ROS3FSContext::ReadFile(OpenedFile &file, char *buf, size_t size,
+                                off_t offset) {
+  if (file.control) {
+    if (static_cast<size_t>(offset) >= file.contents.size()) {
+      return 0;
+    }
+    const size_t n = std::min(size, file.contents.size() - offset);
+    memcpy(buf, file.contents.data() + offset, n);
+    return n;
+  }
+
+  const int fd = OpenCacheFile(file);
+  if (fd < 0) {
+    return fd;
+  }
+  const int r = WaitForData(file, size, offset);
+  if (r < 0) {
+    return r;
+  }
+  return cache_io_->Read(fd, buf, file.ReadSize(size, offset),
+                         file.base + offset);
+}
+
+int ROS3FSContext::WaitForData(OpenedFile &file, const size_t size,
+                               const off_t offset) {
+  std::shared_ptr<Download> download;
+  {
+    std::lock_guard<std::mutex> lock(file.mutex);
+    download = file.download;
+  }
+  if (download == nullptr) {
+    return 0;
+  }
+
+  const uint64_t end = std::min<uint64_t>(offset + size, download->size);
+  std::unique_lock<std::mutex> lock(download->mutex);
+  download->cv.wait(lock, [&] {
+    return download->watermark >= end || download->error < 0;
+  });
+  return download->watermark >= end ? 0 : download->error;
+}
+
+void ROS3FSContext::CloseFile(OpenedFile &file) {
+  std::lock_guard<std::mutex> lock(file.mutex);
+  if (file.segment != nullptr) {
+    // The segment is shared with other files and closed by PackSegment.
+    file.segment.reset();
+    file.fd = -1;
+  } else if (file.fd >= 0) {
+    cache_io_->UnregisterFile(file.fd);
+    close(file.fd);
+    file.fd = -1;
+  }
+  file.download.reset();
+}
+
+// Cautions: This function is not thread safe.
+void ROS3FSContext::VisitFilesLocked(
+    const std::function<void(const std::filesystem::path &,
+                             const FileMetaData &)> &visitor) {
+  std::vector<std::pair<std::filesystem::path, std::shared_ptr<Directory>>>
+      stack = {{"/", root_directory_}};
+  while (!stack.empty()) {
+    const auto [p, d] = stack.back();
+    stack.pop_back();
+    if (d->self.type == FileType::kFile) {
+      visitor(p, d->self);
+      continue;
+    }
+    for (const auto &child : d->directories) {
+      stack.emplace_back(p / child.first, child.second);
+    }
+  }
+}
+
+// Cautions: This function is not thread safe. Adds or updates `md` in the tree
+// and marks all nodes on its path with `generation`. Paths whose cache files
+// become stale are appended to `stale_objects`. Returns true when the tree
+// changes.
+bool ROS3FSContext::UpsertObjectLocked(
+    const ObjectMetaData &md, const uint64_t generation,
+    std::vector<std::filesystem::path> *stale_objects) {
+  std::vector<std::filesystem::path> dirs(md.path.begin(), md.path.end());
+  CHECK_GE(dirs.size(), static_cast<size_t>(1));
+  CHECK_EQ(dirs[0], "/");
+  // Directory markers such as "dir/" only create their directories like in
+  // lazy listing mode.
+  const bool directory_marker = dirs.size() > 1 && dirs.back().empty();
+  if (directory_marker) {
+    dirs.pop_back();
+  }
+
+  std::shared_ptr<Directory> current_dir = root_directory_;
+  current_dir->generation = generation;
+  std::filesystem::path current_path = "/";
+  bool changed = false;
+  for (size_t i = 1; i < dirs.size(); i++) {
+    const std::string name = dirs[i];
+    current_path /= name;
+    const auto it = current_dir->directories.find(name);
+    if (dirs.size() != i + 1 || directory_marker) {
+      // Directory
+      if (it == current_dir->directories.end() ||
+          it->second->self.type != FileType::kDirectory) {
+        if (it != current_dir->directories.end()) {
+          HideFileLocked(current_path);
+          CollectFiles(it->second, current_path, stale_objects);
+        }
+        current_dir->directories[name] = std::make_shared<Directory>(
+            Directory{.self = FileMetaData{.name = name,
+                                           .size = 0,
+                                           .type = FileType::kDirectory,
+                                           .unix_time_millis =
+                                               md.unix_time_millis}});
+        changed = true;
+      }
+      current_dir = current_dir->directories[name];
+      current_dir->generation = generation;
     } else {
-      const Aws::S3::S3Error &err = outcome.GetError();
-      LOG(FATAL) << "Error: GetObject: " << err.GetExceptionName() << ": "
-                 << err.GetMessage() << std::endl;
+      // File
+      if (it != current_dir->directories.end() &&
+          it->second->self.type == FileType::kDirectory) {
+        // Keys such as "a" and "a/b" both exist. Keep the directory so that
+        // the node does not flip at every refresh.
+        HideFileLocked(current_path);
+        break;
+      }
+      if (it != current_dir->directories.end() &&
+          it->second->self.type == FileType::kFile &&
+          it->second->self.size == md.size &&
+          it->second->self.unix_time_millis == md.unix_time_millis) {
+        // Unchanged. Keep its cache file.
+        it->second->generation = generation;
+        break;
+      }
+      changed = true;
+      if (it != current_dir->directories.end()) {
+        CollectFiles(it->second, current_path, stale_objects);
+      }
+      current_dir->directories[name] = std::make_shared<Directory>(
+          Directory{.self = FileMetaData{.name = name,
+                                         .size = md.size,
+                                         .type = FileType::kFile,
+                                         .unix_time_millis =
+                                             md.unix_time_millis},
+                    .generation = generation});
     }
   }
+  return changed;
+}
+
+// Cautions: This function is not thread safe. Logs `path` the first time a
+// directory with the same name hides the file.
+void ROS3FSContext::HideFileLocked(const std::filesystem::path &path) {
+  if (hidden_files_.insert(path.string()).second) {
+    LOG(WARNING) << "Hide file " << path
+                 << " because a directory has the same name";
+  }
+}
+
+// Cautions: This function is not thread safe. Removes nodes which are not
+// marked with `generation`.
+void ROS3FSContext::SweepLocked(
+    const uint64_t generation,
+    std::vector<std::filesystem::path> *stale_objects) {
+  const int64_t t =
+      SweepDirectory(root_directory_, "/", generation, stale_objects);
+  // TODO: When the bucket is created?
+  root_directory_->self.unix_time_millis = t == INT64_MAX ? 0 : t;
+}
+
+// Lists the bucket to a new metadata file and applies it to the tree only
+// after the listing succeeds. Neither the listing nor the tree is held in
+// memory twice, and a failed listing leaves the tree and meta_data_path_ as
+// they were. `marker_etag` is saved with the listing when it is set. The file
+// is applied in batches of list_max_keys_ objects and lookups can run between
+// them. Paths whose cache files became stale are appended to `stale_objects`.
+// Returns false when listing fails.
+bool ROS3FSContext::RefreshMetaData(
+    const std::optional<std::string> &marker_etag,
+    std::vector<std::filesystem::path> *stale_objects) {
+  size_t n_objects = 0;
+  {
+    ObjectMetaDataWriter writer(meta_data_path_);
+    if (!writer.IsOpen()) {
+      LOG(ERROR) << "Failed to open " << meta_data_path_
+                 << ". Keep the current metadata.";
+      return false;
+    }
+    if (marker_etag.has_value()) {
+      writer.WriteMarker(MarkerETag{.key = marker_key_, .etag = *marker_etag});
+    }
+    const bool ok = FetchObjectMetaData(
+        *s3_, bucket_name_, list_max_keys_, "",
+        [&](const std::vector<ObjectMetaData> &page) {
+          for (const auto &md : page) {
+            writer.Write(md);
+          }
+          n_objects += page.size();
+        });
+    if (!ok) {
+      LOG(ERROR) << "Failed to list " << bucket_name_ << " after "
+                 << n_objects << " objects. Keep the current metadata.";
+      return false;
+    }
+    LOG(INFO) << "Save metadata to " << meta_data_path_;
+    if (!writer.Close()) {
+      LOG(ERROR) << "Failed to save metadata to " << meta_data_path_
+                 << ". Keep the current metadata.";
+      return false;
+    }
+  }
+
+  const uint64_t generation = ++meta_data_generation_;
+  std::vector<ObjectMetaData> batch;
+  const auto apply = [&]() {
+    // Critical section start
+    std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+    bool changed = false;
+    for (const auto &md : batch) {
+      changed |= UpsertObjectLocked(md, generation, stale_objects);
+    }
+    if (changed) {
+      DropPathIndexLocked();
+    }
+    // Critical section end
+    batch.clear();
+  };
+  ReadObjectMetaData(meta_data_path_, [&](const ObjectMetaData &md) {
+    batch.emplace_back(md);
+    if (batch.size() >= static_cast<size_t>(list_max_keys_)) {
+      apply();
+    }
+  });
+  apply();
 
   {
-    std::lock_guard<std::mutex> lock(cache_file_mutex_);
-    std::ifstream input(cache_file, std::ios::binary);
-    const std::vector<uint8_t> d(std::istreambuf_iterator<char>(input), {});
-    return d;
+    // Critical section start
+    LOG(INFO) << "Try to lock meta_data_mutex_";
+    std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+
+    const size_t n_stale_objects = stale_objects->size();
+    SweepLocked(generation, stale_objects);
+    if (stale_objects->size() != n_stale_objects) {
+      DropPathIndexLocked();
+    }
+    // Critical section end
+  }
+  LOG(INFO) << LOG_KEY(n_objects) << LOG_KEY(stale_objects->size());
+  return true;
+}
+
+// Relists the whole bucket. The marker ETag and the change log are read before
+// listing so that changes made during the listing are seen next time.
+bool ROS3FSContext::FullRefresh(
+    std::vector<std::filesystem::path> *stale_objects) {
+  std::optional<std::string> etag;
+  if (!marker_key_.empty()) {
+    std::string e;
+    const int r = s3_->HeadObject(bucket_name_, marker_key_, &e);
+    if (r == 0 || r == -ENOENT) {
+      etag = e;
+    }
+  }
+  if (!change_log_.empty()) {
+    // The full listing covers everything in the change log so far.
+    std::set<std::string> ignored;
+    ReadChangeLog(&ignored);
+  }
+
+  if (!RefreshMetaData(etag, stale_objects)) {
+    full_refresh_pending_ = true;
+    return false;
   }
+  marker_etag_ = etag;
+  full_refresh_pending_ = false;
+  return true;
 }
 
-std::vector<ObjectMetaData> ROS3FSContext::FetchObjectMetaDataFromS3() {
-  std::vector<ObjectMetaData> result_files;
+// Lists objects under `prefix` such as "dir/sub/" and applies them to the tree.
+// Objects under `prefix` which are gone are removed. Returns false when
+// listing fails.
+bool ROS3FSContext::RelistPrefix(
+    const std::string &prefix,
+    std::vector<std::filesystem::path> *stale_objects) {
+  const uint64_t generation = ++meta_data_generation_;
+  const bool ok = FetchObjectMetaData(
+      *s3_, bucket_name_, list_max_keys_, prefix,
+      [&](const std::vector<ObjectMetaData> &page) {
+        // Critical section start
+        std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+        bool changed = false;
+        for (const auto &md : page) {
+          changed |= UpsertObjectLocked(md, generation, stale_objects);
+        }
+        if (changed) {
+          DropPathIndexLocked();
+        }
+        // Critical section end
+      });
+  if (!ok) {
+    LOG(ERROR) << "Failed to list " << prefix << " in " << bucket_name_;
+    return false;
+  }
+
+  // Critical section start
+  std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+  const size_t n_stale_objects = stale_objects->size();
 
+  // Pairs of a name and its parent from the top level down to `prefix`.
+  const std::filesystem::path dir_path =
+      "/" + prefix.substr(0, prefix.size() - 1);
+  std::vector<std::pair<std::string, std::shared_ptr<Directory>>> ancestors;
+  std::shared_ptr<Directory> dir = root_directory_;
+  for (const auto &name : dir_path.relative_path()) {
+    ancestors.emplace_back(name.string(), dir);
+    const auto it = dir->directories.find(name.string());
+    if (it == dir->directories.end() ||
+        it->second->self.type != FileType::kDirectory) {
+      dir = nullptr;
+      break;
+    }
+    dir = it->second;
+  }
+
+  if (dir != nullptr) {
+    if (dir->generation != generation) {
+      // No object is under `prefix` anymore.
+      CollectFiles(dir, dir_path, stale_objects);
+      ancestors.back().second->directories.erase(ancestors.back().first);
+    } else {
+      const int64_t t =
+          SweepDirectory(dir, dir_path, generation, stale_objects);
+      if (t != INT64_MAX) {
+        dir->self.unix_time_millis = t;
+      }
+    }
+
+    // Remove directories which became empty and update times of the others
+    // like SweepLocked.
+    for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+      const std::shared_ptr<Directory> &parent = it->second;
+      const auto child = parent->directories.find(it->first);
+      if (child != parent->directories.end() &&
+          child->second->self.type == FileType::kDirectory &&
+          child->second->directories.empty()) {
+        parent->directories.erase(child);
+      }
+      int64_t oldest = INT64_MAX;
+      for (const auto &c : parent->directories) {
+        oldest = std::min(oldest, c.second->self.unix_time_millis);
+      }
+      parent->self.unix_time_millis = oldest == INT64_MAX ? 0 : oldest;
+    }
+  }
+
+  if (stale_objects->size() != n_stale_objects) {
+    DropPathIndexLocked();
+  }
+  // Critical section end
+  return true;
+}
+
+// Writes the tree to meta_data_path_ after relisting only some prefixes.
+void ROS3FSContext::SaveMetaData() {
+  ObjectMetaDataWriter writer(meta_data_path_);
+  if (marker_etag_.has_value()) {
+    writer.WriteMarker(MarkerETag{.key = marker_key_, .etag = *marker_etag_});
+  }
   {
-    Aws::Client::ClientConfiguration clientConfig;
-    clientConfig.endpointOverride = endpoint_;
-    Aws::S3::S3Client s3Client(clientConfig);
+    // Critical section start
+    std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+    VisitFilesLocked(
+        [&](const std::filesystem::path &p, const FileMetaData &meta) {
+          writer.Write(ObjectMetaData{.path = p,
+                                      .size = meta.size,
+                                      .unix_time_millis =
+                                          meta.unix_time_millis});
+        });
+    // Critical section end
+  }
+  LOG_IF(ERROR, !writer.Close())
+      << "Failed to save metadata to " << meta_data_path_;
+}
 
+// Returns prefixes which may have changed since the last refresh, or
+// std::nullopt when the whole bucket must be relisted. Without any change
+// detector, the whole bucket is relisted every time.
+std::optional<std::vector<std::string>> ROS3FSContext::ChangedPrefixes() {
+  if (marker_key_.empty() && change_log_.empty() && !sample_prefixes_) {
+    return std::nullopt;
+  }
+
+  if (!marker_key_.empty()) {
+    std::string etag;
+    const int r = s3_->HeadObject(bucket_name_, marker_key_, &etag);
+    if (r == 0 || r == -ENOENT) {
+      if (etag != marker_etag_) {
+        LOG(INFO) << "Marker " << marker_key_ << " changed"
+                  << LOG_KEY(etag) << LOG_KEY(marker_etag_.value_or("?"));
+        return std::nullopt;
+      }
+    } else {
+      // Check it again next time.
+      LOG(WARNING) << "Failed to check marker " << marker_key_;
+    }
+  }
+
+  std::set<std::string> prefixes;
+  if (!change_log_.empty()) {
+    ReadChangeLog(&prefixes);
+  }
+  if (sample_prefixes_ && !SamplePrefixes(&prefixes)) {
+    return std::nullopt;
+  }
+  if (prefixes.contains("")) {
+    return std::nullopt;
+  }
+
+  // A prefix is followed by prefixes under it in the sorted set.
+  std::vector<std::string> result;
+  for (const auto &p : prefixes) {
+    if (result.empty() || !p.starts_with(result.back())) {
+      result.emplace_back(p);
+    }
+  }
+  return result;
+}
+
+// Adds directory prefixes of lines appended to change_log_ since the last
+// call to `prefixes`. A line without a newline at the end is read next time.
+void ROS3FSContext::ReadChangeLog(std::set<std::string> *prefixes) {
+  std::error_code ec;
+  const uint64_t size = std::filesystem::file_size(change_log_, ec);
+  if (ec) {
+    return;
+  }
+  if (size < change_log_offset_) {
+    LOG(INFO) << change_log_ << " was truncated. Read it from the beginning.";
+    change_log_offset_ = 0;
+  }
+
+  std::ifstream ifs(change_log_);
+  ifs.seekg(change_log_offset_);
+  std::string line;
+  while (std::getline(ifs, line) && !ifs.eof()) {
+    change_log_offset_ += line.size() + 1;
+    if (!line.empty()) {
+      prefixes->insert(DirectoryPrefix(line));
+    }
+  }
+}
+
+// Lists the top level of the bucket with Delimiter="/" and compares it with the
+// tree. New, removed and sampled top level directories which differ are added
+// to `prefixes`. Returns false when files at the top level changed and the
+// whole bucket must be relisted.
+bool ROS3FSContext::SamplePrefixes(std::set<std::string> *prefixes) {
+  std::set<std::string> dirs;
+  std::map<std::string, std::pair<uint64_t, int64_t>> files;
+  Aws::S3::Model::ListObjectsRequest request;
+  request.SetBucket(bucket_name_);
+  request.SetDelimiter("/");
+  request.SetMaxKeys(list_max_keys_);
+  while (true) {
+    const Aws::S3::Model::ListObjectsOutcome outcome =
+        s3_->ListObjects(request);
+    if (!outcome.IsSuccess()) {
+      // Sample again next time.
+      LOG(WARNING) << "Failed to list the top level of " << bucket_name_;
+      return true;
+    }
+    const auto &result = outcome.GetResult();
+    for (const auto &p : result.GetCommonPrefixes()) {
+      dirs.insert(p.GetPrefix());
+    }
+    for (const auto &o : result.GetContents()) {
+      files[o.GetKey()] = {static_cast<uint64_t>(o.GetSize()),
+                           o.GetLastModified().Millis()};
+    }
+    if (!result.GetIsTruncated()) {
+      break;
+    }
+    request.SetMarker(result.GetNextMarker());
+  }
+
+  std::set<std::string> tree_dirs;
+  std::map<std::string, std::pair<uint64_t, int64_t>> tree_files;
+  {
+    // Critical section start
+    std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+    for (const auto &[name, child] : root_directory_->directories) {
+      if (child->self.type == FileType::kDirectory) {
+        tree_dirs.insert(name + "/");
+      } else {
+        tree_files[name] = {child->self.size, child->self.unix_time_millis};
+      }
+    }
+    std::erase_if(files, [&](const auto &f) {
+      return hidden_files_.contains("/" + f.first);
+    });
+    // Critical section end
+  }
+  if (files != tree_files) {
+    LOG(INFO) << "Files at the top level of " << bucket_name_ << " changed";
+    return false;
+  }
+
+  for (const auto &d : dirs) {
+    if (!tree_dirs.contains(d) || SampleDiffers(d)) {
+      prefixes->insert(d);
+    }
+  }
+  for (const auto &d : tree_dirs) {
+    if (!dirs.contains(d)) {
+      prefixes->insert(d);
+    }
+  }
+  return true;
+}
+
+// Compares the page of objects under `prefix` after its cursor with the tree
+// and moves the cursor to the next page. Pages are compared in turn, so a
+// change is noticed within as many updates as `prefix` has pages. Only
+// children of directories which can hold keys of the page are visited.
+// Returns false when they are the same or listing fails.
+bool ROS3FSContext::SampleDiffers(const std::string &prefix) {
+  std::string &cursor = sample_cursors_[prefix];
+  Aws::S3::Model::ListObjectsRequest request;
+  request.SetBucket(bucket_name_);
+  request.SetPrefix(prefix);
+  request.SetMaxKeys(list_max_keys_);
+  if (!cursor.empty()) {
+    request.SetMarker(cursor);
+  }
+  const Aws::S3::Model::ListObjectsOutcome outcome = s3_->ListObjects(request);
+  if (!outcome.IsSuccess()) {
+    LOG(WARNING) << "Failed to sample " << prefix << " in " << bucket_name_;
+    return false;
+  }
+  const auto &result = outcome.GetResult();
+
+  std::vector<SampleEntry> actual;
+  for (const auto &o : result.GetContents()) {
+    actual.emplace_back(SampleEntry{.key = o.GetKey(),
+                                    .size = static_cast<uint64_t>(o.GetSize()),
+                                    .unix_time_millis =
+                                        o.GetLastModified().Millis()});
+  }
+  // Keys in (cursor, high] are in this page.
+  std::optional<std::string> high;
+  if (result.GetIsTruncated() && !actual.empty()) {
+    high = actual.back().key;
+  }
+
+  std::vector<SampleEntry> expected;
+  {
+    // Critical section start
+    std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+    // Directory markers and hidden files are not files in the tree.
+    std::erase_if(actual, [&](const SampleEntry &e) {
+      return e.key.ends_with('/') || hidden_files_.contains("/" + e.key);
+    });
+    const auto it = root_directory_->directories.find(
+        prefix.substr(0, prefix.size() - 1));
+    if (it != root_directory_->directories.end()) {
+      // One more than the page is enough to tell they differ.
+      CollectKeyRange(it->second, prefix, cursor, high, actual.size() + 1,
+                      &expected);
+    }
+    // Critical section end
+  }
+  std::sort(actual.begin(), actual.end());
+  std::sort(expected.begin(), expected.end());
+
+  const bool differs = actual != expected;
+  LOG_IF(INFO, differs) << "Sampled page of " << prefix << " changed"
+                        << LOG_KEY(cursor) << LOG_KEY(actual.size())
+                        << LOG_KEY(expected.size());
+  cursor = high.value_or("");
+  return differs;
+}
+
+// Wakes UpdateLoop for a full refresh and waits until it finishes. Returns a
+// summary of the refresh.
+std::string ROS3FSContext::RequestRefresh() {
+  std::unique_lock<std::mutex> lock(update_metadata_loop_mtx_);
+  const uint64_t ticket = ++refresh_requested_;
+  update_metadata_loop_cv_.notify_all();
+  update_metadata_loop_cv_.wait(lock, [&] {
+    return refresh_done_ >= ticket || update_metadata_loop_stop_;
+  });
+  return last_refresh_summary_;
+}
+
+void ROS3FSContext::InitMetaData() {
+  {
+    // Critical section start
+    LOG(INFO) << "Try to lock meta_data_mutex_";
+    std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+    root_directory_ = std::make_shared<Directory>(
+        Directory{.self = FileMetaData{.name = "/",
+                                       .size = 0,
+                                       .type = FileType::kDirectory,
+                                       .unix_time_millis = 0}});
+    // Critical section end
+  }
+
+  if (!std::filesystem::exists(meta_data_path_) && !snapshot_.empty()) {
+    LOG(INFO) << "Download snapshot from " << snapshot_ << " to "
+              << meta_data_path_;
+    DownloadSnapshot(endpoint_, snapshot_, meta_data_path_);
+  }
+
+  if (std::filesystem::exists(meta_data_path_)) {
+    // Critical section start
+    LOG(INFO) << "Try to lock meta_data_mutex_";
+    std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+
+    LOG(INFO) << "Load metadata from " << meta_data_path_;
+    const uint64_t generation = ++meta_data_generation_;
+    std::vector<std::filesystem::path> stale_objects;
+    std::optional<MarkerETag> marker;
+    ReadObjectMetaData(
+        meta_data_path_,
+        [&](const ObjectMetaData &md) {
+          UpsertObjectLocked(md, generation, &stale_objects);
+        },
+        &marker);
+    SweepLocked(generation, &stale_objects);
+    if (!marker_key_.empty() && marker.has_value() &&
+        marker->key == marker_key_) {
+      // The first update relists the whole bucket only when the marker
+      // changed since the metadata was listed.
+      LOG(INFO) << "Metadata was listed at " << marker_key_
+                << LOG_KEY(marker->etag);
+      marker_etag_ = marker->etag;
+      full_refresh_pending_ = false;
+    } else {
+      // We do not know what changed since the metadata was saved.
+      full_refresh_pending_ = true;
+    }
+    // Critical section end
+  } else {
+    std::vector<std::filesystem::path> stale_objects;
+    CHECK(FullRefresh(&stale_objects)) << "Failed to list " << bucket_name_;
+  }
+}
+
+// Older versions put all cache files flat in cache_dir_ as
+// ros3fs_cache_file_<SHA256 of path>. Move them to the sharded layout. They
+// do not record which version of the object they hold, so only files of the
+// size in the metadata are kept and stamped with its modification time.
+void ROS3FSContext::MigrateCacheLayout() {
+  const std::string old_prefix = "ros3fs_cache_file_";
+
+  std::unordered_map<std::string, std::filesystem::path> old_files;
+  for (const auto &entry : std::filesystem::directory_iterator(cache_dir_)) {
+    const std::string filename = entry.path().filename().string();
+    if (filename.starts_with(old_prefix)) {
+      old_files[filename.substr(old_prefix.size())] = entry.path();
+    }
+  }
+  if (old_files.empty()) {
+    return;
+  }
+  LOG(INFO) << "Migrate " << old_files.size() << " cache files in "
+            << cache_dir_ << " to the sharded layout";
+
+  std::vector<std::pair<std::filesystem::path, FileMetaData>> files;
+  {
+    // Critical section start
+    LOG(INFO) << "Try to lock meta_data_mutex_";
+    std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+
+    VisitFilesLocked(
+        [&](const std::filesystem::path &p, const FileMetaData &meta) {
+          files.emplace_back(p, meta);
+        });
+    // Critical section end
+  }
+
+  std::lock_guard<std::mutex> lock(cache_file_mutex_);
+  size_t n_migrated = 0;
+  for (const auto &[p, meta] : files) {
+    const auto it = old_files.find(GetSHA256(p.string()));
+    if (it == old_files.end()) {
+      continue;
+    }
+    const int fd = open(it->second.c_str(), O_RDWR);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat st;
+    const bool ok = fstat(fd, &st) == 0 &&
+                    static_cast<uint64_t>(st.st_size) == meta.size &&
+                    StampCacheFile(fd, meta) == 0;
+    close(fd);
+    if (!ok) {
+      continue;
+    }
+    const std::filesystem::path cache_file = CacheFilePath(p);
+    std::filesystem::create_directories(cache_file.parent_path());
+    std::filesystem::rename(it->second, cache_file);
+    old_files.erase(it);
+    n_migrated++;
+  }
+  LOG(INFO) << "Migrated " << n_migrated << " cache files";
+
+  // Objects which are not in the metadata anymore or changed in size.
+  for (const auto &f : old_files) {
+    std::filesystem::remove(f.second);
+  }
+}
+
+void ROS3FSContext::InitLazyMetaData() {
+  // Critical section start
+  LOG(INFO) << "Try to lock meta_data_mutex_";
+  std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+
+  root_directory_ = MakeUnlistedRoot();
+  if (!std::filesystem::exists(lazy_meta_data_path_)) {
+    return;
+  }
+
+  LOG(INFO) << "Replay directory listings from " << lazy_meta_data_path_;
+  std::ifstream ifs(lazy_meta_data_path_);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    // Appends are not synced, so a crash may leave a torn last line. Its
+    // directory stays unlisted and is listed again.
+    const nlohmann::json j =
+        nlohmann::json::parse(line, nullptr, /*allow_exceptions=*/false);
+    if (j.is_discarded()) {
+      LOG(WARNING) << "Skip a broken line in " << lazy_meta_data_path_;
+      continue;
+    }
+    std::vector<FileMetaData> files;
+    for (const auto &j2 : j["files"]) {
+      files.emplace_back(FileMetaData{.name = j2["name"],
+                                      .size = j2["size"],
+                                      .type = FileType::kFile,
+                                      .unix_time_millis =
+                                          j2["unix_time_millis"]});
+    }
+    InstallListing(std::filesystem::path(j["path"]),
+                   j["directories"].get<std::vector<std::string>>(), files);
+  }
+  // Critical section end
+}
+
+// Fetch direct children of `path` using Delimiter="/" and install them to the
+// metadata tree. When another thread is already listing `path`, waits for it
+// and returns true instead of listing it again. Callers look `path` up again.
+// Returns false when listing fails. Then `path` stays unlisted.
+bool ROS3FSContext::ListDirectory(const std::filesystem::path &path) {
+  {
+    std::unique_lock<std::mutex> lock(listings_mutex_);
+    if (listings_.contains(path.string())) {
+      listings_cv_.wait(lock,
+                        [&] { return !listings_.contains(path.string()); });
+      return true;
+    }
+    listings_.insert(path.string());
+  }
+
+  const bool ok = ListDirectoryOnce(path);
+
+  {
+    std::lock_guard<std::mutex> lock(listings_mutex_);
+    listings_.erase(path.string());
+  }
+  listings_cv_.notify_all();
+  return ok;
+}
+
+bool ROS3FSContext::ListDirectoryOnce(const std::filesystem::path &path) {
+  LOG(INFO) << "ListDirectory " << LOG_KEY(path);
+
+  std::string prefix = path.string().substr(1);
+  if (!prefix.empty()) {
+    prefix += "/";
+  }
+
+  std::vector<std::string> directories;
+  std::vector<FileMetaData> files;
+  {
     Aws::S3::Model::ListObjectsRequest objectsRequest;
     objectsRequest.SetBucket(bucket_name_);
-    // TODO: Adjust the value of max keys watching performance.
+    objectsRequest.SetPrefix(prefix);
+    objectsRequest.SetDelimiter("/");
     objectsRequest.SetMaxKeys(list_max_keys_);
 
-    Aws::S3::Model::ListObjectsOutcome objectsOutcome;
     bool isTruncated = false;
     std::string nextMarker;
-
-    std::chrono::system_clock::time_point startFetchTime =
-        std::chrono::system_clock::now();
     do {
       if (nextMarker != "") {
         objectsRequest.SetMarker(nextMarker);
       }
-      objectsOutcome = s3Client.ListObjects(objectsRequest);
-      if (objectsOutcome.IsSuccess()) {
-        LOG(INFO) << "Objects in bucket: "
-                  << objectsOutcome.GetResult().GetContents().size();
-
-        Aws::Vector<Aws::S3::Model::Object> objects =
-            objectsOutcome.GetResult().GetContents();
+      const Aws::S3::Model::ListObjectsOutcome objectsOutcome =
+          s3_->ListObjects(objectsRequest);
+      if (!objectsOutcome.IsSuccess()) {
+        LOG(ERROR) << "Error listing objects in " << LOG_KEY(prefix) << ": "
+                   << objectsOutcome.GetError().GetMessage() << std::endl;
+        return false;
+      }
 
-        for (const auto &object : objects) {
-          result_files.push_back(ObjectMetaData{
-              .path = "/" + object.GetKey(),
-              .size = static_cast<uint64_t>(object.GetSize()),
-              .unix_time_millis = object.GetLastModified().Millis(),
-          });
+      const auto &result = objectsOutcome.GetResult();
+      std::string lastKey;
+      for (const auto &common_prefix : result.GetCommonPrefixes()) {
+        std::string name = common_prefix.GetPrefix().substr(prefix.size());
+        lastKey = std::max(lastKey, std::string(common_prefix.GetPrefix()));
+        if (!name.empty() && name.back() == '/') {
+          name.pop_back();
         }
+        if (!name.empty()) {
+          directories.emplace_back(name);
+        }
+      }
+      for (const auto &object : result.GetContents()) {
+        const std::string name = object.GetKey().substr(prefix.size());
+        lastKey = std::max(lastKey, std::string(object.GetKey()));
+        // Skip directory markers such as "dir/".
+        if (name.empty()) {
+          continue;
+        }
+        files.emplace_back(FileMetaData{
+            .name = name,
+            .size = static_cast<uint64_t>(object.GetSize()),
+            .type = FileType::kFile,
+            .unix_time_millis = object.GetLastModified().Millis(),
+        });
+      }
 
-        isTruncated = objectsOutcome.GetResult().GetIsTruncated();
-        nextMarker = objectsOutcome.GetResult().GetNextMarker();
-        LOG(INFO) << "Next marker: " << nextMarker << std::endl;
-      } else {
-        LOG(FATAL) << "Error listing objects in bucket: "
-                   << objectsOutcome.GetError().GetMessage() << std::endl;
-        isTruncated = false;
+      isTruncated = result.GetIsTruncated();
+      nextMarker = result.GetNextMarker();
+      if (isTruncated && nextMarker.empty()) {
+        nextMarker = lastKey;
       }
     } while (isTruncated);
-    std::chrono::system_clock::time_point endFetchTime =
-        std::chrono::system_clock::now();
-
-    const auto d =
-        duration_cast<std::chrono::seconds>(endFetchTime - startFetchTime);
-    LOG(INFO) << "Done listing objects in bucket in " << d.count() << "seconds"
-              << std::endl;
   }
+  LOG(INFO) << "ListDirectory " << LOG_KEY(path) << LOG_KEY(directories.size())
+            << LOG_KEY(files.size());
 
-  return result_files;
+  {
+    // Critical section start
+    LOG(INFO) << "Try to lock meta_data_mutex_";
+    std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
+
+    if (InstallListing(path, directories, files)) {
+      std::ofstream ofs(lazy_meta_data_path_, std::ios::app);
+      ofs << SerializeListing(path, directories, files) << std::endl;
+    }
+    // Critical section end
+  }
+  return true;
 }
 
-// Cautions: This function is not thread safe.
-void ROS3FSContext::UpdateRootDir(
-    const std::vector<ObjectMetaData> &meta_datas) {
-  root_directory_ = std::make_shared<Directory>();
+// Cautions: This function is not thread safe. Returns false when `path` is
+// not an unlisted directory anymore, e.g. another thread has listed it.
+bool ROS3FSContext::InstallListing(const std::filesystem::path &path,
+                                   const std::vector<std::string> &directories,
+                                   const std::vector<FileMetaData> &files) {
+  std::vector<std::filesystem::path> dirs(path.begin(), path.end());
+  CHECK_GE(dirs.size(), static_cast<size_t>(1));
+  CHECK_EQ(dirs[0], "/");
 
-  root_directory_->self.name = "/";
-  root_directory_->self.size = 0;
-  root_directory_->self.type = FileType::kDirectory;
+  std::shared_ptr<Directory> current_dir = root_directory_;
+  for (size_t i = 1; i < dirs.size(); i++) {
+    if (!current_dir->directories.contains(dirs[i])) {
+      return false;
+    }
+    current_dir = current_dir->directories.at(dirs[i]);
+  }
+  if (current_dir->listed || current_dir->self.type != FileType::kDirectory) {
+    return false;
+  }
 
-  // TODO: When the bucket is created?
-  root_directory_->self.unix_time_millis = INT64_MAX;
-  for (const auto &md : meta_datas) {
-    root_directory_->self.unix_time_millis =
-        std::min(md.unix_time_millis, root_directory_->self.unix_time_millis);
-  }
-  if (root_directory_->self.unix_time_millis == INT64_MAX) {
-    root_directory_->self.unix_time_millis = 0;
-  }
-
-  LOG(INFO) << LOG_KEY(meta_datas.size());
-  for (const auto &md : meta_datas) {
-    // TODO: Handle empty directory.
-    std::vector<std::filesystem::path> dirs(md.path.begin(), md.path.end());
-    CHECK_GE(dirs.size(), static_cast<size_t>(1));
-    CHECK_EQ(dirs[0], "/");
-
-    std::shared_ptr<Directory> current_dir = root_directory_;
-    for (size_t i = 1; i < dirs.size(); i++) {
-      if (dirs.size() != i + 1) {
-        // Directory
-        if (!current_dir->directories.contains(dirs[i])) {
-          current_dir->directories[dirs[i]] = std::make_shared<Directory>(
-              Directory{.self = FileMetaData{.name = dirs[i],
-                                             .size = 0,
-                                             .type = FileType::kDirectory,
-                                             .unix_time_millis =
-                                                 md.unix_time_millis}});
-        } else {
-          current_dir->directories[dirs[i]]->self.unix_time_millis =
-              std::min(current_dir->directories[dirs[i]]->self.unix_time_millis,
-                       md.unix_time_millis);
-        }
-        current_dir = current_dir->directories[dirs[i]];
-      } else {
-        // File
-        CHECK(!current_dir->directories.contains(dirs[i]));
-        current_dir->directories[dirs[i]] =
-            std::make_shared<Directory>(Directory{
-                .self = FileMetaData{.name = dirs[i],
-                                     .size = md.size,
-                                     .type = FileType::kFile,
-                                     .unix_time_millis = md.unix_time_millis}});
-      }
+  for (const auto &name : directories) {
+    if (!current_dir->directories.contains(name)) {
+      current_dir->directories[name] = std::make_shared<Directory>(
+          Directory{.self = FileMetaData{.name = name,
+                                         .size = 0,
+                                         .type = FileType::kDirectory,
+                                         .unix_time_millis = 0},
+                    .listed = false});
+    }
+  }
+  for (const auto &f : files) {
+    if (current_dir->directories.contains(f.name)) {
+      HideFileLocked(path / f.name);
+      continue;
+    }
+    current_dir->directories[f.name] =
+        std::make_shared<Directory>(Directory{.self = f});
+    if (current_dir->self.unix_time_millis == 0 ||
+        f.unix_time_millis < current_dir->self.unix_time_millis) {
+      current_dir->self.unix_time_millis = f.unix_time_millis;
     }
   }
+  current_dir->listed = true;
+  return true;
 }
 
-void ROS3FSContext::InitMetaData() {
-  if (std::filesystem::exists(meta_data_path_)) {
-    LOG(INFO) << "Loading meta data from " << meta_data_path_;
-
+void ROS3FSContext::LazyCrawlLoop() {
+  // Directories which failed to be listed are skipped until the next update
+  // so that a persistent error such as 403 does not make us list them again
+  // and again.
+  std::set<std::filesystem::path> failed;
+  while (true) {
+    std::vector<std::filesystem::path> unlisted;
     {
       // Critical section start
-      LOG(INFO) << "Try to lock meta_data_mutex_";
-      std::lock_guard<std::mutex> lock(meta_data_mutex_);
-
-      LOG(INFO) << "Load metadata from " << meta_data_path_;
-      std::ifstream ifs(meta_data_path_);
-      std::string json((std::istreambuf_iterator<char>(ifs)),
-                       (std::istreambuf_iterator<char>()));
-      const auto meta_datas = DeserializeObjectMetaData(json);
-      UpdateRootDir(meta_datas);
+      std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+      std::vector<std::pair<std::filesystem::path, std::shared_ptr<Directory>>>
+          stack = {{"/", root_directory_}};
+      while (!stack.empty()) {
+        const auto [p, d] = stack.back();
+        stack.pop_back();
+        if (d->self.type != FileType::kDirectory) {
+          continue;
+        }
+        if (!d->listed) {
+          if (!failed.contains(p)) {
+            unlisted.emplace_back(p);
+          }
+          continue;
+        }
+        for (const auto &child : d->directories) {
+          stack.emplace_back(p / child.first, child.second);
+        }
+      }
       // Critical section end
     }
-  } else {
-    const auto meta_datas = FetchObjectMetaDataFromS3();
 
-    {
-      // Critical section start
-      LOG(INFO) << "Try to lock meta_data_mutex_";
-      std::lock_guard<std::mutex> lock(meta_data_mutex_);
+    if (unlisted.empty()) {
+      std::unique_lock<std::mutex> lock(update_metadata_loop_mtx_);
+      if (update_metadata_loop_stop_) {
+        break;
+      }
+      update_metadata_loop_cv_.wait_for(lock,
+                                        std::chrono::seconds(update_seconds_));
+      if (update_metadata_loop_stop_) {
+        break;
+      }
+      failed.clear();
+      continue;
+    }
 
-      LOG(INFO) << "Save metadata to " << meta_data_path_;
-      std::ofstream ofs(meta_data_path_);
-      ofs << SerializeObjectMetaData(meta_datas);
-      UpdateRootDir(meta_datas);
-      // Critical section end
+    LOG(INFO) << "LazyCrawlLoop " << LOG_KEY(unlisted.size())
+              << LOG_KEY(failed.size());
+    for (const auto &p : unlisted) {
+      if (update_metadata_loop_stop_) {
+        return;
+      }
+      if (!ListDirectory(p)) {
+        failed.insert(p);
+      }
     }
   }
 }
 
+// Cautions: This function is not thread safe. Returns the node at `dirs` or
+// nullptr when it does not exist. In lazy listing mode, `unlisted` is set when
+// a directory on the way must be listed before answering.
+std::shared_ptr<Directory>
+ROS3FSContext::LookUpLocked(const std::vector<std::filesystem::path> &dirs,
+                            const bool need_children,
+                            std::optional<std::filesystem::path> *unlisted) {
+  std::shared_ptr<Directory> current_dir = root_directory_;
+  for (size_t i = 0; i < dirs.size(); i++) {
+    VLOG(3) << LOG_KEY(dirs.size()) << LOG_KEY(i) << LOG_KEY(dirs[i])
+            << LOG_KEY(current_dir->directories.size())
+            << LOG_KEY(current_dir->self.name);
+    if (dirs.size() == i + 1 && !need_children) {
+      return current_dir;
+    }
+
+    if (!current_dir->listed) {
+      std::filesystem::path p;
+      for (size_t j = 0; j <= i; j++) {
+        p /= dirs[j];
+      }
+      *unlisted = p;
+      return nullptr;
+    }
+
+    if (dirs.size() == i + 1) {
+      return current_dir;
+    }
+
+    if (!current_dir->directories.contains(dirs[i + 1])) {
+      return nullptr;
+    } else {
+      VLOG(3) << LOG_KEY(dirs[i + 1]);
+      current_dir = current_dir->directories.at(dirs[i + 1]);
+    }
+  }
+  return nullptr;
+}
+
 void ROS3FSContext::UpdateLoop() {
   while (true) {
+    // Refreshes requested up to this one are served by this iteration.
+    uint64_t requested = 0;
+    bool forced = false;
     {
       std::unique_lock<std::mutex> lock(update_metadata_loop_mtx_);
-      update_metadata_loop_cv_.wait_for(lock,
-                                        std::chrono::seconds(update_seconds_));
+      update_metadata_loop_cv_.wait_for(
+          lock, std::chrono::seconds(update_seconds_), [&] {
+            return update_metadata_loop_stop_ ||
+                   refresh_requested_ > refresh_done_;
+          });
       if (update_metadata_loop_stop_) {
         // TODO: Do we need this break? std::thread::join() automatically
         // breaks, doesn't it?
         break;
       }
+      requested = refresh_requested_;
+      forced = requested > refresh_done_;
     }
-    LOG(INFO) << "FetchObjectMetaDataFromS3 start";
-    const auto meta_datas = FetchObjectMetaDataFromS3();
-    LOG(INFO) << "FetchObjectMetaDataFromS3 end";
-    {
-      // Critical section start
-      LOG(INFO) << "Try to lock meta_data_mutex_";
-      std::lock_guard<std::mutex> lock(meta_data_mutex_);
+    std::string summary;
+    if (lazy_list_) {
+      {
+        // Critical section start
+        LOG(INFO) << "Try to lock meta_data_mutex_";
+        std::lock_guard<std::shared_mutex> lock(meta_data_mutex_);
 
-      LOG(INFO) << "Save metadata to " << meta_data_path_;
-      std::ofstream ofs(meta_data_path_);
-      ofs << SerializeObjectMetaData(meta_datas);
-      UpdateRootDir(meta_datas);
-      // Critical section end
-    }
-    {
-      std::lock_guard<std::mutex> lock(cache_file_mutex_);
-      LOG(INFO) << "Clear cache files in " << cache_dir_;
-      for (const auto &entry :
-           std::filesystem::directory_iterator(cache_dir_)) {
-        if (std::filesystem::canonical(entry.path()) != lock_dir_ &&
-            std::filesystem::canonical(entry.path()) != meta_data_path_) {
-          std::filesystem::remove_all(entry.path());
+        // Directories are listed again when they are looked up next time.
+        LOG(INFO) << "Reset lazy listing metadata " << lazy_meta_data_path_;
+        root_directory_ = MakeUnlistedRoot();
+        std::ofstream ofs(lazy_meta_data_path_, std::ios::trunc);
+        // Critical section end
+      }
+      {
+        // We cannot tell which objects are changed without the whole listing.
+        std::lock_guard<std::mutex> downloads_lock(downloads_mutex_);
+        std::lock_guard<std::mutex> lock(cache_file_mutex_);
+        LOG(INFO) << "Clear cache files in " << cache_dir_;
+        while (!downloads_.empty()) {
+          AbandonDownloadLocked(downloads_.begin()->first);
+        }
+        if (pack_store_ != nullptr) {
+          pack_store_->Clear();
+        }
+        for (const auto &entry :
+             std::filesystem::directory_iterator(cache_dir_)) {
+          if (std::filesystem::canonical(entry.path()) != lock_dir_ &&
+              (pack_store_ == nullptr ||
+               std::filesystem::canonical(entry.path()) !=
+                   pack_store_->dir()) &&
+              std::filesystem::canonical(entry.path()) != meta_data_path_ &&
+              std::filesystem::canonical(entry.path()) !=
+                  lazy_meta_data_path_) {
+            std::filesystem::remove_all(entry.path());
+          }
+        }
+      }
+      summary = "reset lazy listing\n";
+    } else {
+      std::vector<std::filesystem::path> stale_objects;
+      const std::optional<std::vector<std::string>> prefixes =
+          forced || full_refresh_pending_ ? std::nullopt : ChangedPrefixes();
+      if (!prefixes.has_value()) {
+        LOG(INFO) << "RefreshMetaData start";
+        const bool ok = FullRefresh(&stale_objects);
+        LOG(INFO) << "RefreshMetaData end";
+        summary = ok ? "relisted the whole bucket\n"
+                     : "failed to list the whole bucket\n";
+      } else {
+        for (const auto &prefix : *prefixes) {
+          LOG(INFO) << "Relist " << prefix;
+          if (!RelistPrefix(prefix, &stale_objects)) {
+            // We may have lost changes in the change log.
+            full_refresh_pending_ = true;
+            summary += "failed to list " + prefix + "\n";
+          } else {
+            summary += "relisted " + prefix + "\n";
+          }
+        }
+        if (!prefixes->empty()) {
+          SaveMetaData();
+        } else {
+          summary = "no changes detected\n";
+        }
+      }
+      summary +=
+          "stale objects: " + std::to_string(stale_objects.size()) + "\n";
+      LOG(INFO) << "S3 request stats:\n" << s3_->Stats();
+      RebuildPathIndex();
+      RebuildNameIndex();
+      {
+        // Keep cache files of unchanged objects. This only reclaims space.
+        // OpenCacheFile does not use stale cache files even before they are
+        // removed here.
+        std::lock_guard<std::mutex> downloads_lock(downloads_mutex_);
+        std::lock_guard<std::mutex> lock(cache_file_mutex_);
+        LOG(INFO) << "Remove " << stale_objects.size()
+                  << " stale cache files in " << cache_dir_;
+        for (const auto &p : stale_objects) {
+          const std::filesystem::path cache_file = CacheFilePath(p);
+          AbandonDownloadLocked(cache_file);
+          std::filesystem::remove(cache_file);
+          if (pack_store_ != nullptr) {
+            pack_store_->Remove(p.string());
+          }
         }
       }
+      if (pack_store_ != nullptr) {
+        pack_store_->Compact();
+      }
+      InvalidateKernelCache(stale_objects);
+    }
+    {
+      std::lock_guard<std::mutex> lock(update_metadata_loop_mtx_);
+      refresh_done_ = requested;
+      last_refresh_summary_ = summary;
     }
+    // Wake up the crawler to list the new tree and readers of
+    // /.ros3fs/refresh.
+    update_metadata_loop_cv_.notify_all();
   }
 }
 
-ROS3FSContext::ROS3FSContext(const std::string &endpoint,
-                             const std::string &bucket_name,
-                             const int update_seconds, const int list_max_keys,
-                             const std::filesystem::path &cache_dir,
-                             const bool clear_cache)
-    : endpoint_(endpoint), bucket_name_(bucket_name),
-      cache_dir_(std::filesystem::canonical(cache_dir)),
-      clear_cache_(clear_cache),
-      lock_dir_(std::filesystem::canonical(cache_dir) / "lock"),
-      update_seconds_(update_seconds), list_max_keys_(list_max_keys),
-      meta_data_path_(
-          std::filesystem::canonical(cache_dir) /
-          ("ros3fs_meta_data_" + GetSHA256(endpoint + bucket_name) + ".json")) {
-  CHECK_NE(endpoint, "");
-  CHECK_NE(bucket_name, "");
-  CHECK(std::filesystem::exists(cache_dir));
-  LOG(INFO) << "ROS3FSContext initialized with endpoint=" << endpoint
-            << " bucket_name=" << bucket_name
-            << " cache_dir=" << std::filesystem::canonical(cache_dir);
+ROS3FSContext::ROS3FSContext(const ROS3FSContextOptions &options)
+    : endpoint_(options.endpoint), bucket_name_(options.bucket_name),
+      cache_dir_(std::filesystem::canonical(options.cache_dir)),
+      clear_cache_(options.clear_cache),
+      lock_dir_(std::filesystem::canonical(options.cache_dir) / "lock"),
+      update_seconds_(options.update_seconds),
+      list_max_keys_(options.list_max_keys), lazy_list_(options.lazy_list),
+      lazy_crawl_(options.lazy_crawl), snapshot_(options.snapshot),
+      marker_key_(options.marker_key), change_log_(options.change_log),
+      sample_prefixes_(options.sample_prefixes),
+      meta_data_path_(std::filesystem::canonical(options.cache_dir) /
+                      ("ros3fs_meta_data_" +
+                       GetSHA256(options.endpoint + options.bucket_name) +
+                       ".json")),
+      lazy_meta_data_path_(std::filesystem::canonical(options.cache_dir) /
+                           ("ros3fs_lazy_meta_data_" +
+                            GetSHA256(options.endpoint + options.bucket_name) +
+                            ".jsonl")),
+      pack_threshold_(
+          std::min<uint64_t>(options.pack_threshold, kMaxPackThreshold)),
+      range_size_(options.range_size),
+      invalidate_path_(options.invalidate_path),
+      name_index_enabled_(options.name_index),
+      path_index_enabled_(options.path_index) {
+  CHECK_NE(endpoint_, "");
+  CHECK_NE(bucket_name_, "");
+  CHECK(std::filesystem::exists(options.cache_dir));
+  LOG(INFO) << "ROS3FSContext initialized with endpoint=" << endpoint_
+            << " bucket_name=" << bucket_name_ << " cache_dir=" << cache_dir_
+            << " lazy_list=" << lazy_list_ << " lazy_crawl=" << lazy_crawl_
+            << " snapshot=" << snapshot_;
+  LOG_IF(WARNING, lazy_list_ && !snapshot_.empty())
+      << "--snapshot is ignored with --lazy_list.";
+  LOG_IF(WARNING, lazy_list_ && name_index_enabled_)
+      << "--name_index is ignored with --lazy_list.";
 
   CHECK(std::filesystem::create_directory(lock_dir_))
       << "Failed to create lock directory: " << lock_dir_
@@ -316,6 +1656,13 @@ ROS3FSContext::ROS3FSContext(const std::string &endpoint,
     }
   }
 
+  cache_io_ = std::make_unique<CacheIO>(options.use_io_uring);
+  if (pack_threshold_ > 0) {
+    pack_store_ = std::make_unique<PackStore>(cache_dir_ / "pack",
+                                              options.pack_segment_size,
+                                              options.pack_max_bytes);
+  }
+
   LOG(INFO) << "Initialize AWS SDK API";
   // The AWS SDK for C++ must be initialized by calling Aws::InitAPI.
   Aws::InitAPI(sdk_options_);
@@ -330,12 +1677,23 @@ ROS3FSContext::ROS3FSContext(const std::string &endpoint,
     CHECK(outcome.IsSuccess())
         << "Failed to list buckets: " << outcome.GetError().GetMessage();
   }
+  s3_ = std::make_unique<RetryingS3Client>(endpoint_, options.retry);
 
-  InitMetaData();
+  if (lazy_list_) {
+    InitLazyMetaData();
+  } else {
+    InitMetaData();
+    RebuildPathIndex();
+    RebuildNameIndex();
+  }
+  MigrateCacheLayout();
 
   sdk_options_.loggingOptions.logLevel = Aws::Utils::Logging::LogLevel::Debug;
 
   update_metadata_loop_thread_ = std::thread(&ROS3FSContext::UpdateLoop, this);
+  if (lazy_list_ && lazy_crawl_) {
+    lazy_crawl_thread_ = std::thread(&ROS3FSContext::LazyCrawlLoop, this);
+  }
 }
 
 ROS3FSContext::~ROS3FSContext() {
@@ -346,8 +1704,21 @@ ROS3FSContext::~ROS3FSContext() {
   }
   update_metadata_loop_cv_.notify_all();
   update_metadata_loop_thread_.join();
+  if (lazy_crawl_thread_.joinable()) {
+    lazy_crawl_thread_.join();
+  }
   LOG(INFO) << "Stopped update_metadata_loop_thread_";
 
+  {
+    std::unique_lock<std::mutex> lock(downloads_mutex_);
+    LOG(INFO) << "Waiting for " << running_downloads_ << " downloads";
+    downloads_stop_ = true;
+    downloads_cv_.wait(lock, [&] { return running_downloads_ == 0; });
+  }
+
+  LOG(INFO) << "S3 request stats:\n" << s3_->Stats();
+  s3_.reset();
+
   LOG(INFO) << "Shutdown AWS SDK API";
   // Before the application terminates, the SDK must be shut down.
   ShutdownAPI(sdk_options_);
@@ -356,72 +1727,272 @@ ROS3FSContext::~ROS3FSContext() {
       << "Failed to remove lock directory: " << lock_dir_;
 }
 
-std::vector<FileMetaData>
-ROS3FSContext::ReadDirectory(const std::filesystem::path &path) {
-  LOG(INFO) << "ReadDirectory " << LOG_KEY(path);
+int ROS3FSContext::ReadDirectory(const std::filesystem::path &path,
+                                 std::vector<FileMetaData> *entries) {
+  VLOG(1) << "ReadDirectory " << LOG_KEY(path);
+
+  if (IsControlPath(path)) {
+    *entries = ReadControlDirectory(path);
+    return 0;
+  }
 
   std::vector<std::filesystem::path> dirs(path.begin(), path.end());
   CHECK_GE(dirs.size(), static_cast<size_t>(1));
   CHECK_EQ(dirs[0], "/");
 
-  {
-    // Critical section start
-    LOG(INFO) << "Try to lock meta_data_mutex_";
-    std::lock_guard<std::mutex> lock(meta_data_mutex_);
-
-    std::shared_ptr<Directory> current_dir = root_directory_;
-    for (size_t i = 0; i < dirs.size(); i++) {
-      VLOG(3) << LOG_KEY(dirs.size()) << LOG_KEY(i) << LOG_KEY(dirs[i])
-              << LOG_KEY(current_dir->directories.size())
-              << LOG_KEY(current_dir->self.name);
-      if (dirs.size() == i + 1) {
-        std::vector<FileMetaData> result;
-        for (const auto &dir : current_dir->directories) {
-          result.emplace_back(dir.second->self);
+  while (true) {
+    std::optional<std::filesystem::path> unlisted;
+    {
+      // Critical section start
+      std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+
+      const std::shared_ptr<Directory> dir =
+          LookUpLocked(dirs, /*need_children=*/true, &unlisted);
+      if (!unlisted.has_value()) {
+        entries->clear();
+        if (dir != nullptr) {
+          for (const auto &d : dir->directories) {
+            entries->emplace_back(d.second->self);
+          }
         }
-        return result;
+        return 0;
       }
+      // Critical section end
+    }
+    if (!ListDirectory(unlisted.value())) {
+      return -EIO;
+    }
+  }
+}
 
-      if (!current_dir->directories.contains(dirs[i + 1])) {
-        return {};
-      } else {
-        VLOG(3) << LOG_KEY(dirs[i + 1]);
-        current_dir = current_dir->directories.at(dirs[i + 1]);
-      }
+int ROS3FSContext::GetAttr(const std::filesystem::path &path,
+                           FileMetaData *meta) {
+  if (IsControlPath(path)) {
+    const std::optional<FileMetaData> m = GetControlAttr(path);
+    if (!m.has_value()) {
+      return -ENOENT;
     }
-    // Critical section end
+    *meta = m.value();
+    return 0;
   }
 
-  return {};
-}
+  std::shared_ptr<const PathIndex> path_index;
+  {
+    std::shared_lock<std::shared_mutex> lock(path_index_mutex_);
+    path_index = path_index_;
+  }
+  if (path_index != nullptr) {
+    // One probe for both hits and misses without splitting `path`.
+    const FileMetaData *m = path_index->Find(path.string());
+    if (m == nullptr) {
+      return -ENOENT;
+    }
+    *meta = *m;
+    return 0;
+  }
 
-std::optional<FileMetaData>
-ROS3FSContext::GetAttr(const std::filesystem::path &path) {
   std::vector<std::filesystem::path> dirs(path.begin(), path.end());
   CHECK_GE(dirs.size(), static_cast<size_t>(1));
   CHECK_EQ(dirs[0], "/");
 
+  while (true) {
+    std::optional<std::filesystem::path> unlisted;
+    {
+      // Critical section start
+      std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+
+      const std::shared_ptr<Directory> dir =
+          LookUpLocked(dirs, /*need_children=*/false, &unlisted);
+      if (!unlisted.has_value()) {
+        if (dir == nullptr) {
+          return -ENOENT;
+        }
+        *meta = dir->self;
+        return 0;
+      }
+      // Critical section end
+    }
+    if (!ListDirectory(unlisted.value())) {
+      return -EIO;
+    }
+  }
+}
+
+// The kernel keeps attributes and pages of files until they are invalidated.
+// Drop them for changed or removed objects and their parent directories whose
+// times may change. Names expire after entry_timeout instead because
+// fuse_invalidate_path only invalidates inodes.
+void ROS3FSContext::InvalidateKernelCache(
+    const std::vector<std::filesystem::path> &stale_objects) {
+  if (!invalidate_path_) {
+    return;
+  }
+
+  std::set<std::filesystem::path> paths;
+  for (const auto &p : stale_objects) {
+    for (std::filesystem::path q = p; q != q.root_path(); q = q.parent_path()) {
+      if (!paths.insert(q).second) {
+        break;
+      }
+    }
+  }
+  LOG(INFO) << "Invalidate " << paths.size() << " paths in the kernel cache";
+  // Children first while libfuse still knows their parents.
+  for (auto it = paths.rbegin(); it != paths.rend(); ++it) {
+    invalidate_path_(*it);
+  }
+}
+
+void ROS3FSContext::RebuildNameIndex() {
+  if (!name_index_enabled_ || lazy_list_) {
+    return;
+  }
+
+  auto name_index = std::make_shared<NameIndex>();
   {
     // Critical section start
     LOG(INFO) << "Try to lock meta_data_mutex_";
-    std::lock_guard<std::mutex> lock(meta_data_mutex_);
+    std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
 
-    std::shared_ptr<Directory> current_dir = root_directory_;
-    for (size_t i = 0; i < dirs.size(); i++) {
-      VLOG(3) << LOG_KEY(dirs[i]);
-      if (dirs.size() == i + 1) {
-        return current_dir->self;
-      }
+    VisitFilesLocked(
+        [&](const std::filesystem::path &p, const FileMetaData &) {
+          name_index->Add(p.string());
+        });
+    // Critical section end
+  }
+  LOG(INFO) << "Rebuilt name index with " << name_index->size() << " files";
 
-      VLOG(3) << LOG_KEY(dirs[i + 1]);
-      if (!current_dir->directories.contains(dirs[i + 1])) {
-        return std::nullopt;
-      } else {
-        current_dir = current_dir->directories.at(dirs[i + 1]);
+  std::lock_guard<std::mutex> lock(name_index_mutex_);
+  name_index_ = name_index;
+}
+
+// Indexes all files and directories in the tree unless the current index is
+// still up to date.
+void ROS3FSContext::RebuildPathIndex() {
+  if (!path_index_enabled_ || lazy_list_) {
+    return;
+  }
+  {
+    std::shared_lock<std::shared_mutex> lock(path_index_mutex_);
+    if (path_index_ != nullptr) {
+      return;
+    }
+  }
+
+  std::vector<std::pair<std::string, FileMetaData>> entries;
+  {
+    // Critical section start
+    LOG(INFO) << "Try to lock meta_data_mutex_";
+    std::shared_lock<std::shared_mutex> lock(meta_data_mutex_);
+
+    std::vector<std::pair<std::filesystem::path, std::shared_ptr<Directory>>>
+        stack = {{"/", root_directory_}};
+    while (!stack.empty()) {
+      const auto [p, d] = stack.back();
+      stack.pop_back();
+      entries.emplace_back(p.string(), d->self);
+      for (const auto &child : d->directories) {
+        stack.emplace_back(p / child.first, child.second);
       }
     }
     // Critical section end
   }
+  auto path_index = std::make_shared<PathIndex>(std::move(entries));
+  LOG(INFO) << "Rebuilt path index with " << path_index->size() << " paths";
+
+  // Only UpdateLoop and the constructor change the tree in this mode, and they
+  // call this function after changing it.
+  std::lock_guard<std::shared_mutex> lock(path_index_mutex_);
+  path_index_ = path_index;
+}
+
+// Cautions: This function is not thread safe. Call this with
+// meta_data_mutex_ held whenever the tree changes so that GetAttr does not see
+// a stale index.
+void ROS3FSContext::DropPathIndexLocked() {
+  std::lock_guard<std::shared_mutex> lock(path_index_mutex_);
+  path_index_.reset();
+}
+
+bool ROS3FSContext::IsControlPath(const std::filesystem::path &path) {
+  const std::filesystem::path control_dir(kControlDir);
+  return std::mismatch(control_dir.begin(), control_dir.end(), path.begin(),
+                       path.end())
+             .first == control_dir.end();
+}
 
+// Control files are:
+//   /.ros3fs/query/<glob>  Paths of files whose names match <glob>. One path
+//                          in a line. Needs --name_index.
+//   /.ros3fs/stats         Latency histograms and retries of S3 requests.
+//   /.ros3fs/refresh       Relists the whole bucket and returns a summary
+//                          when it finishes. Not shown in the directory so
+//                          that tools walking the tree do not trigger it.
+std::optional<std::string>
+ROS3FSContext::ReadControlFile(const std::filesystem::path &path) {
+  if (path == std::filesystem::path(kControlDir) / "stats") {
+    return s3_->Stats();
+  }
+  if (path == std::filesystem::path(kControlDir) / "refresh") {
+    return RequestRefresh();
+  }
+  if (path.parent_path() == std::filesystem::path(kControlDir) / "query") {
+    std::shared_ptr<const NameIndex> name_index;
+    {
+      std::lock_guard<std::mutex> lock(name_index_mutex_);
+      name_index = name_index_;
+    }
+    if (name_index == nullptr) {
+      return std::nullopt;
+    }
+
+    std::string contents;
+    for (const auto &p : name_index->Query(path.filename().string())) {
+      contents += p + "\n";
+    }
+    return contents;
+  }
   return std::nullopt;
 }
+
+std::optional<FileMetaData>
+ROS3FSContext::GetControlAttr(const std::filesystem::path &path) {
+  const std::filesystem::path control_dir(kControlDir);
+  if (path == control_dir ||
+      (path == control_dir / "query" && name_index_enabled_)) {
+    return FileMetaData{.name = path.filename().string(),
+                        .size = 0,
+                        .type = FileType::kDirectory,
+                        .unix_time_millis = 0};
+  }
+
+  // Do not refresh or run queries on lookups. Control files are read with
+  // direct_io, so the size does not limit reads.
+  if (path == control_dir / "stats" || path == control_dir / "refresh" ||
+      (path.parent_path() == control_dir / "query" && name_index_enabled_)) {
+    return FileMetaData{.name = path.filename().string(),
+                        .size = 0,
+                        .type = FileType::kFile,
+                        .unix_time_millis = 0};
+  }
+  return std::nullopt;
+}
+
+std::vector<FileMetaData>
+ROS3FSContext::ReadControlDirectory(const std::filesystem::path &path) {
+  std::vector<FileMetaData> result;
+  if (path != std::filesystem::path(kControlDir)) {
+    return result;
+  }
+  if (name_index_enabled_) {
+    result.emplace_back(FileMetaData{.name = "query",
+                                     .size = 0,
+                                     .type = FileType::kDirectory,
+                                     .unix_time_millis = 0});
+  }
+  result.emplace_back(FileMetaData{.name = "stats",
+                                   .size = 0,
+                                   .type = FileType::kFile,
+                                   .unix_time_millis = 0});
+  return result;
+}
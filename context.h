@@ -1,37 +1,145 @@
 // ros3fs: Read Only S3 File System
 // Copyright (C) 2023 Akira Kawata
 
+#include <algorithm>
 #include <aws/core/Aws.h>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <optional>
+#include <set>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
 
+#include "cache_io.h"
 #include "log.h"
+#include "metadata.h"
+#include "name_index.h"
+#include "pack.h"
+#include "path_index.h"
+#include "s3_client.h"
 
-enum class FileType { kFile, kDirectory };
+struct Directory {
+  FileMetaData self;
+  // Sorted by name so that SampleDiffers can visit only children in a range
+  // of keys.
+  std::map<std::string, std::shared_ptr<Directory>> directories;
+  // False when this directory was found as a common prefix in lazy listing
+  // mode and its children have not been fetched from S3 yet.
+  bool listed = true;
+  // Generation of the last refresh which saw this node. Nodes with older
+  // generations are removed at the end of a refresh.
+  uint64_t generation = 0;
+};
 
-struct FileMetaData {
-  std::string name;
-  uint64_t size;
-  FileType type;
-  int64_t unix_time_millis;
+struct ROS3FSContextOptions {
+  std::string endpoint;
+  std::string bucket_name;
+  int update_seconds = 0;
+  int list_max_keys = 0;
+  std::filesystem::path cache_dir;
+  bool clear_cache = false;
+  // List a directory with Delimiter="/" when it is looked up for the first
+  // time instead of listing the whole bucket at startup.
+  bool lazy_list = false;
+  // List the remaining directories in background in lazy listing mode.
+  bool lazy_crawl = false;
+  // Use io_uring for cache file I/O when it is available.
+  bool use_io_uring = true;
+  // Metadata snapshot built by ros3fs-index used when there is no metadata in
+  // cache_dir. A local path or s3://BUCKET/KEY.
+  std::string snapshot;
+  // Objects up to this size are stored in pack segments instead of their own
+  // cache files. 0 disables pack segments.
+  uint64_t pack_threshold = 0;
+  uint64_t pack_segment_size = 0;
+  // Maximum total size of pack segments. 0 means no limit.
+  uint64_t pack_max_bytes = 0;
+  // Build NameIndex and serve /.ros3fs/query/<glob>.
+  bool name_index = false;
+  // Answer GetAttr from PathIndex instead of walking the tree. Ignored in lazy
+  // listing mode.
+  bool path_index = true;
+  // Called with paths whose attributes and pages cached by the kernel
+  // become stale after a refresh. Must not be called with locks held because
+  // the kernel may look the path up again.
+  std::function<void(const std::filesystem::path &)> invalidate_path;
+  RetryOptions retry;
+  // Objects are downloaded in ranges of this size.
+  uint64_t range_size = 8 << 20;
+  // Change detectors. When any of them is set, each update relists only what
+  // they report instead of the whole bucket. Ignored in lazy listing mode.
+  // Key of an object which writers overwrite after changing the bucket. The
+  // whole bucket is relisted when its ETag changes.
+  std::string marker_key;
+  // Local file to which changed keys or prefixes are appended one per line.
+  // Their directories are relisted.
+  std::filesystem::path change_log;
+  // Compare a random page of each top level directory with the tree and
+  // relist directories which differ.
+  bool sample_prefixes = false;
 };
 
-struct ObjectMetaData {
-  std::filesystem::path path;
-  uint64_t size;
-  int64_t unix_time_millis;
+// An object being downloaded to its cache file. Bytes below watermark are
+// already written to tmp_file and can be read before the download completes.
+// tmp_file is empty for a download to a pack segment, which is read only after
+// it is done.
+struct Download {
+  std::filesystem::path tmp_file;
+  // Version of the object being downloaded.
+  uint64_t size = 0;
+  int64_t unix_time_millis = 0;
+  // Set with downloads_mutex_ held when the object changed or its cache file
+  // was removed during the download. Then tmp_file is already removed and the
+  // download is not renamed to the cache file. Readers which opened it still
+  // read it to the end.
+  bool abandoned = false;
+  // You must get mutex before accessing watermark, error and done. cv is
+  // notified when they change.
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint64_t watermark = 0;
+  // -errno when the download failed.
+  int error = 0;
+  bool done = false;
 };
 
-struct Directory {
-  FileMetaData self;
-  std::unordered_map<std::string, std::shared_ptr<Directory>> directories;
+// A file opened through FUSE. Stored in fuse_file_info::fh between open and
+// release.
+struct OpenedFile {
+  std::filesystem::path path;
+  std::filesystem::path cache_file;
+  // Control files have their contents in memory instead of a cache file.
+  bool control = false;
+  std::string contents;
+  // You must get mutex before accessing fd. fd is opened on the first read.
+  std::mutex mutex;
+  int fd = -1;
+  // Set when the object is stored in a pack segment. Then fd is the fd of the
+  // segment and the object is at [base, base + size) in it.
+  std::shared_ptr<PackSegment> segment;
+  off_t base = 0;
+  uint64_t size = 0;
+  // Set when the file was opened while its cache file was being downloaded.
+  // Then fd is the fd of the temporary file.
+  std::shared_ptr<Download> download;
+
+  // Returns the number of bytes to read from the cache file for a read of
+  // `read_size` bytes at `offset` in the object.
+  size_t ReadSize(const size_t read_size, const off_t offset) const {
+    if (segment == nullptr) {
+      return read_size;
+    }
+    if (static_cast<uint64_t>(offset) >= size) {
+      return 0;
+    }
+    return std::min<uint64_t>(read_size, size - offset);
+  }
 };
 
 class ROS3FSContext {
@@ -39,21 +147,38 @@ public:
   ROS3FSContext(ROS3FSContext const &) = delete;
   void operator=(ROS3FSContext const &) = delete;
   static ROS3FSContext &GetContext() {
-    return GetContextImpl("", "", 0, 0, "", false);
+    return GetContextImpl(ROS3FSContextOptions{});
   }
-  static void InitContext(const std::string &endpoint,
-                          const std::string &bucket_name,
-                          const int update_seconds, const int list_max_keys,
-                          const std::filesystem::path &cache_dir,
-                          const bool clear_cache) {
-    GetContextImpl(endpoint, bucket_name, update_seconds, list_max_keys,
-                   cache_dir, clear_cache);
+  static void InitContext(const ROS3FSContextOptions &options) {
+    GetContextImpl(options);
   }
 
-  std::vector<FileMetaData> ReadDirectory(const std::filesystem::path &path);
-  std::optional<FileMetaData> GetAttr(const std::filesystem::path &path);
+  // These return 0 or -errno. A missing directory has no entries.
+  int ReadDirectory(const std::filesystem::path &path,
+                    std::vector<FileMetaData> *entries);
+  int GetAttr(const std::filesystem::path &path, FileMetaData *meta);
+
+  // Virtual files to control ros3fs live under kControlDir. They hide objects
+  // with the same prefix in the bucket.
+  static constexpr char kControlDir[] = "/.ros3fs";
+  static bool IsControlPath(const std::filesystem::path &path);
+  // Returns the contents of the control file `path` or std::nullopt when it
+  // does not exist.
+  std::optional<std::string> ReadControlFile(const std::filesystem::path &path);
 
-  std::vector<uint8_t> GetFileContents(const std::filesystem::path &path);
+  // Returns the cache file of `path`. Call this once when opening a file and
+  // keep the result in OpenedFile.
+  std::filesystem::path CacheFilePath(const std::filesystem::path &path) const;
+  // Returns the fd of the cache file of `file`, or -errno. When the cache file
+  // does not exist, it starts downloading it in background and returns the
+  // fd of the partial file. Call WaitForData before reading it.
+  int OpenCacheFile(OpenedFile &file);
+  // Blocks until [offset, offset + size) of the file opened by OpenCacheFile
+  // is downloaded. Returns 0 or -errno.
+  int WaitForData(OpenedFile &file, size_t size, off_t offset);
+  // Returns the number of bytes read or -errno.
+  ssize_t ReadFile(OpenedFile &file, char *buf, size_t size, off_t offset);
+  void CloseFile(OpenedFile &file);
   std::filesystem::path cache_dir() const { return cache_dir_; }
 
 private:
@@ -64,15 +189,71 @@ private:
   const std::filesystem::path lock_dir_;
   const uint64_t update_seconds_;
   const int list_max_keys_;
+  const bool lazy_list_;
+  const bool lazy_crawl_;
+  const std::string snapshot_;
+  const std::string marker_key_;
+  const std::filesystem::path change_log_;
+  const bool sample_prefixes_;
 
-  // You must get meta_data_mutex_ before accessing root_directory_ and
-  // meta_data_path_.
-  std::mutex meta_data_mutex_;
+  // You must get meta_data_mutex_ before accessing root_directory_,
+  // hidden_files_ and meta_data_path_. Lookups from FUSE threads share it.
+  std::shared_mutex meta_data_mutex_;
   std::shared_ptr<Directory> root_directory_;
+  uint64_t meta_data_generation_ = 0;
+  // Files hidden by directories with the same names, which are logged once.
+  std::set<std::string> hidden_files_;
   const std::filesystem::path meta_data_path_;
+  // Journal of directory listings in lazy listing mode. Each line is the
+  // result of listing one directory.
+  const std::filesystem::path lazy_meta_data_path_;
+  // Only UpdateLoop and the constructor access these. marker_etag_ is
+  // std::nullopt when the ETag of the marker at the last full relist is
+  // unknown.
+  std::optional<std::string> marker_etag_;
+  uint64_t change_log_offset_ = 0;
+  bool full_refresh_pending_ = false;
+  // Key after which SampleDiffers compares the next page of each top level
+  // directory. Empty to start from the first key.
+  std::map<std::string, std::string> sample_cursors_;
 
-  // You must get cache_file_mutex_ before accessing any cache file.
+  // You must get cache_file_mutex_ before creating, renaming or removing any
+  // cache file. Reading an opened cache file does not need it.
   std::mutex cache_file_mutex_;
+  std::unique_ptr<CacheIO> cache_io_;
+  // You must get downloads_mutex_ before accessing downloads_ and
+  // running_downloads_, and before cache_file_mutex_ when you need both.
+  // downloads_ is keyed by cache file paths. running_downloads_ also counts
+  // abandoned downloads which are not in downloads_ anymore.
+  std::mutex downloads_mutex_;
+  std::condition_variable downloads_cv_;
+  std::unordered_map<std::string, std::shared_ptr<Download>> downloads_;
+  size_t running_downloads_ = 0;
+  std::atomic<bool> downloads_stop_ = false;
+  const uint64_t pack_threshold_;
+  // nullptr when pack segments are disabled.
+  std::unique_ptr<PackStore> pack_store_;
+
+  // Created after Aws::InitAPI and destroyed before Aws::ShutdownAPI.
+  std::unique_ptr<RetryingS3Client> s3_;
+  const uint64_t range_size_;
+
+  const std::function<void(const std::filesystem::path &)> invalidate_path_;
+
+  const bool name_index_enabled_;
+  // You must get name_index_mutex_ before accessing name_index_. Queries use
+  // a copy of the pointer so that a rebuild does not block them.
+  std::mutex name_index_mutex_;
+  std::shared_ptr<const NameIndex> name_index_;
+
+  const bool path_index_enabled_;
+  // You must get path_index_mutex_ before accessing path_index_, and get
+  // meta_data_mutex_ before it when you need both. path_index_ is nullptr
+  // while the tree has changes which are not in it yet. Then GetAttr walks
+  // the tree. GetAttr copies the pointer in shared mode so that lookups from
+  // FUSE threads do not serialize on it.
+  std::shared_mutex path_index_mutex_;
+  std::shared_ptr<const PathIndex> path_index_;
 
   Aws::SDKOptions sdk_options_;
 
@@ -80,26 +261,82 @@ private:
   std::atomic<bool> update_metadata_loop_stop_ = false;
   std::mutex update_metadata_loop_mtx_;
   std::condition_variable update_metadata_loop_cv_;
+  // Directories being listed by ListDirectory in lazy listing mode. Other
+  // lookups of them wait on listings_cv_ instead of listing them again. You
+  // must get listings_mutex_ before accessing listings_.
+  std::mutex listings_mutex_;
+  std::condition_variable listings_cv_;
+  std::set<std::string> listings_;
+
+  // Refreshes requested through /.ros3fs/refresh and finished by UpdateLoop.
+  // You must get update_metadata_loop_mtx_ before accessing them.
+  uint64_t refresh_requested_ = 0;
+  uint64_t refresh_done_ = 0;
+  std::string last_refresh_summary_;
   std::thread update_metadata_loop_thread_;
+  std::thread lazy_crawl_thread_;
 
-  ROS3FSContext(const std::string &endpoint, const std::string &bucket_name,
-                const int update_metadata_seconds, const int list_max_keys,
-                const std::filesystem::path &cache_dir, const bool clear_cache);
+  ROS3FSContext(const ROS3FSContextOptions &options);
   ~ROS3FSContext();
 
-  static ROS3FSContext &GetContextImpl(const std::string &endpoint,
-                                       const std::string &bucket_name,
-                                       const int update_metadata_seconds,
-                                       const int list_max_keys,
-                                       const std::filesystem::path &cache_dir,
-                                       const bool clear_cache) {
-    static ROS3FSContext context(endpoint, bucket_name, update_metadata_seconds,
-                                 list_max_keys, cache_dir, clear_cache);
+  static ROS3FSContext &GetContextImpl(const ROS3FSContextOptions &options) {
+    static ROS3FSContext context(options);
     return context;
   }
 
   void InitMetaData();
-  std::vector<ObjectMetaData> FetchObjectMetaDataFromS3();
+  void MigrateCacheLayout();
+  int DownloadToCache(const std::filesystem::path &path,
+                      const FileMetaData &meta, const int fd,
+                      Download &download);
+  void RunDownload(const std::filesystem::path path, const FileMetaData meta,
+                   const std::filesystem::path cache_file, const int fd,
+                   const std::shared_ptr<Download> download);
+  void AbandonDownloadLocked(const std::filesystem::path &cache_file);
+  int DownloadToPack(const std::filesystem::path &path,
+                     const std::filesystem::path &cache_file,
+                     const FileMetaData &meta);
+  int OpenPackedFile(OpenedFile &file, const FileMetaData &meta);
+  void VisitFilesLocked(
+      const std::function<void(const std::filesystem::path &,
+                               const FileMetaData &)> &visitor);
+  bool RefreshMetaData(const std::optional<std::string> &marker_etag,
+                       std::vector<std::filesystem::path> *stale_objects);
+  bool FullRefresh(std::vector<std::filesystem::path> *stale_objects);
+  bool RelistPrefix(const std::string &prefix,
+                    std::vector<std::filesystem::path> *stale_objects);
+  void SaveMetaData();
+  std::optional<std::vector<std::string>> ChangedPrefixes();
+  void ReadChangeLog(std::set<std::string> *prefixes);
+  bool SamplePrefixes(std::set<std::string> *prefixes);
+  bool SampleDiffers(const std::string &prefix);
+  std::string RequestRefresh();
+  bool UpsertObjectLocked(const ObjectMetaData &md, const uint64_t generation,
+                          std::vector<std::filesystem::path> *stale_objects);
+  void HideFileLocked(const std::filesystem::path &path);
+  void SweepLocked(const uint64_t generation,
+                   std::vector<std::filesystem::path> *stale_objects);
   void UpdateLoop();
-  void UpdateRootDir(const std::vector<ObjectMetaData> &meta_datas);
+  void RebuildNameIndex();
+  void RebuildPathIndex();
+  void DropPathIndexLocked();
+  void InvalidateKernelCache(
+      const std::vector<std::filesystem::path> &stale_objects);
+  std::optional<FileMetaData>
+  GetControlAttr(const std::filesystem::path &path);
+  std::vector<FileMetaData>
+  ReadControlDirectory(const std::filesystem::path &path);
+
+  // Lazy listing mode
+  void InitLazyMetaData();
+  bool ListDirectory(const std::filesystem::path &path);
+  bool ListDirectoryOnce(const std::filesystem::path &path);
+  bool InstallListing(const std::filesystem::path &path,
+                      const std::vector<std::string> &directories,
+                      const std::vector<FileMetaData> &files);
+  void LazyCrawlLoop();
+  std::shared_ptr<Directory>
+  LookUpLocked(const std::vector<std::filesystem::path> &dirs,
+               const bool need_children,
+               std::optional<std::filesystem::path> *unlisted);
 };
@@ -0,0 +1,265 @@
+#! /usr/bin/env python3
+# ros3fs: Read Only S3 File System
+# Copyright (C) 2023 Akira Kawata
+"""A minimal S3 stand-in which serves a local directory and injects faults.
+
+Each directory under --root is a bucket. Only the requests ros3fs sends are
+implemented: ListBuckets, ListObjects (V1) and GetObject with Range and
+If-Match. Both path style (/bucket/key) and virtual hosted style
+(bucket.host/key) are accepted.
+
+Fault rates can be changed while running with
+    curl 'http://localhost:<port>/_faults?error_rate=1.0'
+"""
+
+import argparse
+import email.utils
+import hashlib
+import os
+import random
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from xml.sax.saxutils import escape
+
+XMLNS = "http://s3.amazonaws.com/doc/2006-03-01/"
+
+
+class Faults:
+    def __init__(self, error_rate, delay_rate, delay_ms, reset_rate):
+        self.lock = threading.Lock()
+        self.error_rate = error_rate
+        self.delay_rate = delay_rate
+        self.delay_ms = delay_ms
+        self.reset_rate = reset_rate
+
+    def update(self, query):
+        with self.lock:
+            for name in ["error_rate", "delay_rate", "delay_ms", "reset_rate"]:
+                if name in query:
+                    setattr(self, name, float(query[name][0]))
+
+    def snapshot(self):
+        with self.lock:
+            return (self.error_rate, self.delay_rate, self.delay_ms,
+                    self.reset_rate)
+
+
+def iso8601(t):
+    return time.strftime("%Y-%m-%dT%H:%M:%S.000Z", time.gmtime(t))
+
+
+def etag(path):
+    st = os.stat(path)
+    h = hashlib.md5(f"{path}:{st.st_size}:{st.st_mtime_ns}".encode())
+    return '"' + h.hexdigest() + '"'
+
+
+def list_keys(bucket_dir):
+    keys = []
+    for dirpath, _, filenames in os.walk(bucket_dir):
+        for f in filenames:
+            full = os.path.join(dirpath, f)
+            keys.append(os.path.relpath(full, bucket_dir).replace(os.sep, "/"))
+    return sorted(keys)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    root = None
+    faults = None
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+    def send_body(self, code, body, headers={}):
+        self.send_response(code)
+        for k, v in headers.items():
+            self.send_header(k, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+
+    def send_xml(self, code, xml):
+        self.send_body(code,
+                       ('<?xml version="1.0" encoding="UTF-8"?>\n' +
+                        xml).encode(), {"Content-Type": "application/xml"})
+
+    def send_error_xml(self, code, s3_code, message):
+        self.send_xml(
+            code, f"<Error><Code>{s3_code}</Code>"
+            f"<Message>{escape(message)}</Message></Error>")
+
+    # Returns (bucket, key). bucket is None for ListBuckets.
+    def bucket_and_key(self, path):
+        host = self.headers.get("Host", "").split(":")[0]
+        first = host.split(".")[0]
+        if "." in host and os.path.isdir(os.path.join(self.root, first)):
+            return first, path.lstrip("/")
+        parts = path.lstrip("/").split("/", 1)
+        if parts[0] == "":
+            return None, ""
+        return parts[0], parts[1] if len(parts) > 1 else ""
+
+    def inject(self):
+        error_rate, delay_rate, delay_ms, reset_rate = self.faults.snapshot()
+        if random.random() < delay_rate:
+            time.sleep(delay_ms / 1000)
+        if random.random() < reset_rate:
+            self.close_connection = True
+            return True
+        if random.random() < error_rate:
+            self.send_error_xml(503, "SlowDown", "Injected fault")
+            return True
+        return False
+
+    def do_HEAD(self):
+        self.do_GET()
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        query = urllib.parse.parse_qs(url.query, keep_blank_values=True)
+        path = urllib.parse.unquote(url.path)
+
+        if path == "/_faults":
+            self.faults.update(query)
+            self.send_body(200, repr(self.faults.snapshot()).encode() + b"\n")
+            return
+
+        bucket, key = self.bucket_and_key(path)
+        # Keep ListBuckets, which ros3fs uses as a sanity check at startup,
+        # out of the faults.
+        if bucket is None:
+            self.list_buckets()
+            return
+        if self.inject():
+            return
+
+        bucket_dir = os.path.join(self.root, bucket)
+        if not os.path.isdir(bucket_dir):
+            self.send_error_xml(404, "NoSuchBucket", bucket)
+        elif key == "":
+            self.list_objects(bucket, bucket_dir, query)
+        else:
+            self.get_object(os.path.join(bucket_dir, key))
+
+    def list_buckets(self):
+        buckets = "".join(
+            f"<Bucket><Name>{escape(b)}</Name>"
+            f"<CreationDate>{iso8601(os.stat(os.path.join(self.root, b)).st_mtime)}"
+            "</CreationDate></Bucket>" for b in sorted(os.listdir(self.root))
+            if os.path.isdir(os.path.join(self.root, b)))
+        self.send_xml(
+            200, f'<ListAllMyBucketsResult xmlns="{XMLNS}">'
+            "<Owner><ID>ros3fs</ID><DisplayName>ros3fs</DisplayName></Owner>"
+            f"<Buckets>{buckets}</Buckets></ListAllMyBucketsResult>")
+
+    def list_objects(self, bucket, bucket_dir, query):
+        prefix = query.get("prefix", [""])[0]
+        delimiter = query.get("delimiter", [""])[0]
+        marker = query.get("marker", [""])[0]
+        max_keys = int(query.get("max-keys", ["1000"])[0])
+
+        # Entries are (key, is_common_prefix) in the order of keys.
+        entries = []
+        for key in list_keys(bucket_dir):
+            if not key.startswith(prefix):
+                continue
+            rest = key[len(prefix):]
+            if delimiter and delimiter in rest:
+                common = prefix + rest[:rest.index(delimiter) + len(delimiter)]
+                if not entries or entries[-1] != (common, True):
+                    entries.append((common, True))
+            else:
+                entries.append((key, False))
+        entries = [e for e in entries if e[0] > marker]
+        truncated = len(entries) > max_keys
+        entries = entries[:max_keys]
+
+        contents = []
+        for key, is_prefix in entries:
+            if is_prefix:
+                contents.append(f"<CommonPrefixes><Prefix>{escape(key)}"
+                                "</Prefix></CommonPrefixes>")
+                continue
+            full = os.path.join(bucket_dir, key)
+            st = os.stat(full)
+            contents.append(
+                f"<Contents><Key>{escape(key)}</Key>"
+                f"<LastModified>{iso8601(st.st_mtime)}</LastModified>"
+                f"<ETag>{escape(etag(full))}</ETag><Size>{st.st_size}</Size>"
+                "<StorageClass>STANDARD</StorageClass></Contents>")
+        next_marker = ""
+        if truncated:
+            next_marker = f"<NextMarker>{escape(entries[-1][0])}</NextMarker>"
+        self.send_xml(
+            200, f'<ListBucketResult xmlns="{XMLNS}">'
+            f"<Name>{escape(bucket)}</Name><Prefix>{escape(prefix)}</Prefix>"
+            f"<Marker>{escape(marker)}</Marker><MaxKeys>{max_keys}</MaxKeys>"
+            f"<Delimiter>{escape(delimiter)}</Delimiter>"
+            f"<IsTruncated>{str(truncated).lower()}</IsTruncated>"
+            f"{next_marker}{''.join(contents)}</ListBucketResult>")
+
+    def get_object(self, full):
+        if not os.path.isfile(full):
+            self.send_error_xml(404, "NoSuchKey", full)
+            return
+        if self.headers.get("If-Match", etag(full)) != etag(full):
+            self.send_error_xml(412, "PreconditionFailed", "If-Match")
+            return
+        st = os.stat(full)
+        size = st.st_size
+        begin, end = 0, size - 1
+        code = 200
+        headers = {
+            "Content-Type": "application/octet-stream",
+            "Last-Modified": email.utils.formatdate(st.st_mtime, usegmt=True),
+            "ETag": etag(full),
+            "Accept-Ranges": "bytes",
+        }
+        r = self.headers.get("Range")
+        if r is not None and r.startswith("bytes="):
+            first, last = r[len("bytes="):].split("-", 1)
+            begin = int(first)
+            end = min(int(last), size - 1) if last else size - 1
+            if begin >= size or begin > end:
+                self.send_error_xml(416, "InvalidRange", r)
+                return
+            code = 206
+            headers["Content-Range"] = f"bytes {begin}-{end}/{size}"
+        with open(full, "rb") as f:
+            f.seek(begin)
+            body = f.read(end - begin + 1)
+        self.send_body(code, body, headers)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--root", required=True,
+                        help="Directory whose subdirectories are buckets")
+    parser.add_argument("--port", type=int, default=9878)
+    parser.add_argument("--error_rate", type=float, default=0.0,
+                        help="Fraction of requests failing with 503 SlowDown")
+    parser.add_argument("--delay_rate", type=float, default=0.0,
+                        help="Fraction of requests delayed by --delay_ms")
+    parser.add_argument("--delay_ms", type=float, default=1000.0)
+    parser.add_argument("--reset_rate", type=float, default=0.0,
+                        help="Fraction of connections closed without response")
+    parser.add_argument("--seed", type=int, default=None)
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    random.seed(args.seed)
+    Handler.root = os.path.abspath(args.root)
+    Handler.faults = Faults(args.error_rate, args.delay_rate, args.delay_ms,
+                            args.reset_rate)
+    server = ThreadingHTTPServer(("0.0.0.0", args.port), Handler)
+    server.verbose = args.verbose
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
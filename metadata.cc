@@ -0,0 +1,254 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "metadata.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <utility>
+
+#include <aws/core/Aws.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/GetObjectRequest.h>
+#include <aws/s3/model/ListObjectsRequest.h>
+#include <aws/s3/model/PutObjectRequest.h>
+
+namespace {
+
+// Returns the bucket and the key when `location` is s3://BUCKET/KEY.
+std::optional<std::pair<std::string, std::string>>
+ParseS3Location(const std::string &location) {
+  const std::string scheme = "s3://";
+  if (!location.starts_with(scheme)) {
+    return std::nullopt;
+  }
+  const std::string rest = location.substr(scheme.size());
+  const size_t slash = rest.find('/');
+  CHECK_NE(slash, std::string::npos)
+      << "S3 location must be s3://BUCKET/KEY: " << location;
+  return std::make_pair(rest.substr(0, slash), rest.substr(slash + 1));
+}
+
+} // namespace
+
+bool FetchObjectMetaData(
+    RetryingS3Client &client, const std::string &bucket_name,
+    const int list_max_keys, const std::string &prefix,
+    const std::function<void(const std::vector<ObjectMetaData> &)> &on_page) {
+  std::vector<ObjectMetaData> page;
+  size_t n_objects = 0;
+
+  Aws::S3::Model::ListObjectsRequest objectsRequest;
+  objectsRequest.SetBucket(bucket_name);
+  // TODO: Adjust the value of max keys watching performance.
+  objectsRequest.SetMaxKeys(list_max_keys);
+  if (!prefix.empty()) {
+    objectsRequest.SetPrefix(prefix);
+  }
+
+  bool isTruncated = false;
+  std::string nextMarker;
+
+  std::chrono::system_clock::time_point startFetchTime =
+      std::chrono::system_clock::now();
+  do {
+    if (nextMarker != "") {
+      objectsRequest.SetMarker(nextMarker);
+    }
+    const Aws::S3::Model::ListObjectsOutcome objectsOutcome =
+        client.ListObjects(objectsRequest);
+    if (!objectsOutcome.IsSuccess()) {
+      LOG(ERROR) << "Error listing objects in bucket: "
+                 << objectsOutcome.GetError().GetMessage() << std::endl;
+      return false;
+    }
+    LOG(INFO) << "Objects in bucket: "
+              << objectsOutcome.GetResult().GetContents().size();
+
+    const Aws::Vector<Aws::S3::Model::Object> &objects =
+        objectsOutcome.GetResult().GetContents();
+
+    page.clear();
+    std::string lastKey;
+    for (const auto &object : objects) {
+      lastKey = std::max(lastKey, std::string(object.GetKey()));
+      page.push_back(ObjectMetaData{
+          .path = "/" + object.GetKey(),
+          .size = static_cast<uint64_t>(object.GetSize()),
+          .unix_time_millis = object.GetLastModified().Millis(),
+      });
+    }
+    on_page(page);
+    n_objects += page.size();
+
+    isTruncated = objectsOutcome.GetResult().GetIsTruncated();
+    nextMarker = objectsOutcome.GetResult().GetNextMarker();
+    // S3 returns NextMarker only when Delimiter is set.
+    if (isTruncated && nextMarker.empty()) {
+      nextMarker = lastKey;
+    }
+    LOG(INFO) << "Next marker: " << nextMarker << std::endl;
+  } while (isTruncated);
+  std::chrono::system_clock::time_point endFetchTime =
+      std::chrono::system_clock::now();
+
+  const auto d = std::chrono::duration_cast<std::chrono::seconds>(
+      endFetchTime - startFetchTime);
+  LOG(INFO) << "Done listing " << n_objects << " objects in bucket in "
+            << d.count() << "seconds" << std::endl;
+  return true;
+}
+
+ObjectMetaDataWriter::ObjectMetaDataWriter(const std::filesystem::path &path)
+    : path_(path), tmp_path_(path.string() + ".tmp"), ofs_(tmp_path_) {
+  LOG_IF(ERROR, !ofs_) << "Failed to open " << tmp_path_;
+  ofs_ << "[";
+}
+
+void ObjectMetaDataWriter::Write(const ObjectMetaData &md) {
+  nlohmann::json j;
+  j["path"] = md.path;
+  j["size"] = md.size;
+  j["unix_time_millis"] = md.unix_time_millis;
+  if (!first_) {
+    ofs_ << ",";
+  }
+  ofs_ << j.dump();
+  first_ = false;
+}
+
+// The marker is an element of the array without "path".
+void ObjectMetaDataWriter::WriteMarker(const MarkerETag &marker) {
+  nlohmann::json j;
+  j["marker_key"] = marker.key;
+  j["marker_etag"] = marker.etag;
+  if (!first_) {
+    ofs_ << ",";
+  }
+  ofs_ << j.dump();
+  first_ = false;
+}
+
+ObjectMetaDataWriter::~ObjectMetaDataWriter() {
+  if (closed_) {
+    return;
+  }
+  ofs_.close();
+  std::error_code ec;
+  std::filesystem::remove(tmp_path_, ec);
+}
+
+bool ObjectMetaDataWriter::Close() {
+  ofs_ << "]";
+  ofs_.close();
+  if (!ofs_) {
+    LOG(ERROR) << "Failed to write " << tmp_path_;
+    return false;
+  }
+  std::filesystem::rename(tmp_path_, path_);
+  closed_ = true;
+  return true;
+}
+
+void ReadObjectMetaData(
+    const std::filesystem::path &path,
+    const std::function<void(const ObjectMetaData &)> &callback,
+    std::optional<MarkerETag> *marker) {
+  std::ifstream ifs(path);
+  CHECK(ifs) << "Failed to open " << path;
+
+  // Handle each element of the top level array when it is parsed and discard
+  // it instead of building the whole array.
+  nlohmann::json::parser_callback_t cb =
+      [&](int depth, nlohmann::json::parse_event_t event,
+          nlohmann::json &parsed) {
+        if (depth == 1 && event == nlohmann::json::parse_event_t::object_end &&
+            parsed.contains("marker_key")) {
+          if (marker != nullptr) {
+            *marker = MarkerETag{.key = parsed["marker_key"],
+                                 .etag = parsed["marker_etag"]};
+          }
+          return false;
+        }
+        if (depth == 1 && event == nlohmann::json::parse_event_t::object_end) {
+          callback(ObjectMetaData{
+              .path = std::filesystem::path(parsed["path"]),
+              .size = parsed["size"],
+              .unix_time_millis = parsed["unix_time_millis"],
+          });
+          return false;
+        }
+        return true;
+      };
+  // The result is an empty array because all elements are discarded.
+  const nlohmann::json j = nlohmann::json::parse(ifs, cb);
+  (void)j;
+}
+
+bool IsS3Location(const std::string &location) {
+  return ParseS3Location(location).has_value();
+}
+
+void DownloadSnapshot(const std::string &endpoint, const std::string &location,
+                      const std::filesystem::path &path) {
+  const std::filesystem::path tmp_path = path.string() + ".tmp";
+  const auto s3_location = ParseS3Location(location);
+  if (!s3_location.has_value()) {
+    std::filesystem::copy_file(location, tmp_path,
+                               std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::rename(tmp_path, path);
+    return;
+  }
+
+  Aws::Client::ClientConfiguration config;
+  config.endpointOverride = endpoint;
+  Aws::S3::S3Client client(config);
+
+  Aws::S3::Model::GetObjectRequest request;
+  request.SetBucket(s3_location->first);
+  request.SetKey(s3_location->second);
+  // Write the body directly to the file instead of a memory buffer.
+  request.SetResponseStreamFactory([&tmp_path]() {
+    return Aws::New<Aws::FStream>("ros3fs", tmp_path.c_str(),
+                                  std::ios_base::out | std::ios_base::binary |
+                                      std::ios_base::trunc);
+  });
+
+  Aws::S3::Model::GetObjectOutcome outcome = client.GetObject(request);
+  CHECK(outcome.IsSuccess())
+      << "Failed to get snapshot " << location << ": "
+      << outcome.GetError().GetMessage();
+  outcome.GetResult().GetBody().flush();
+  std::filesystem::rename(tmp_path, path);
+}
+
+void UploadSnapshot(const std::string &endpoint,
+                    const std::filesystem::path &path,
+                    const std::string &location) {
+  const auto s3_location = ParseS3Location(location);
+  if (!s3_location.has_value()) {
+    std::filesystem::copy_file(path, location,
+                               std::filesystem::copy_options::overwrite_existing);
+    return;
+  }
+
+  Aws::Client::ClientConfiguration config;
+  config.endpointOverride = endpoint;
+  Aws::S3::S3Client client(config);
+
+  Aws::S3::Model::PutObjectRequest request;
+  request.SetBucket(s3_location->first);
+  request.SetKey(s3_location->second);
+  const std::shared_ptr<Aws::IOStream> body = Aws::MakeShared<Aws::FStream>(
+      "ros3fs-index", path.c_str(), std::ios_base::in | std::ios_base::binary);
+  request.SetBody(body);
+
+  Aws::S3::Model::PutObjectOutcome outcome = client.PutObject(request);
+  CHECK(outcome.IsSuccess())
+      << "Failed to put snapshot " << location << ": "
+      << outcome.GetError().GetMessage();
+}
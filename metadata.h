@@ -0,0 +1,88 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "s3_client.h"
+
+enum class FileType { kFile, kDirectory };
+
+struct FileMetaData {
+  std::string name;
+  uint64_t size;
+  FileType type;
+  int64_t unix_time_millis;
+};
+
+struct ObjectMetaData {
+  std::filesystem::path path;
+  uint64_t size;
+  int64_t unix_time_millis;
+};
+
+// ETag of the object given by --marker_key when a listing started. It is
+// stored with the listing so that a later mount can tell whether the bucket
+// changed since without listing it again.
+struct MarkerETag {
+  std::string key;
+  // Empty when the marker did not exist.
+  std::string etag;
+};
+
+// Aws::InitAPI must be called before using the functions below.
+
+// Lists all objects in `bucket_name` whose keys start with `prefix` and passes
+// them to `on_page` one listing page at a time so that the whole listing is
+// never held in memory. Returns false when listing fails after retries. Pages
+// passed before the failure are not rolled back.
+bool FetchObjectMetaData(
+    RetryingS3Client &client, const std::string &bucket_name,
+    const int list_max_keys, const std::string &prefix,
+    const std::function<void(const std::vector<ObjectMetaData> &)> &on_page);
+
+// Writes ObjectMetaData one by one as a JSON array. The file appears at `path`
+// only after Close succeeds. The temporary file is removed when the writer is
+// destroyed without a successful Close. Writes to a file which failed to open
+// are ignored and Close returns false.
+class ObjectMetaDataWriter {
+public:
+  explicit ObjectMetaDataWriter(const std::filesystem::path &path);
+  ~ObjectMetaDataWriter();
+  ObjectMetaDataWriter(ObjectMetaDataWriter const &) = delete;
+  void operator=(ObjectMetaDataWriter const &) = delete;
+  bool IsOpen() const { return ofs_.is_open(); }
+  void Write(const ObjectMetaData &md);
+  void WriteMarker(const MarkerETag &marker);
+  bool Close();
+
+private:
+  const std::filesystem::path path_;
+  const std::filesystem::path tmp_path_;
+  std::ofstream ofs_;
+  bool first_ = true;
+  bool closed_ = false;
+};
+
+// Reads a file written by ObjectMetaDataWriter without holding all entries in
+// memory. `marker` is set when the file has a MarkerETag.
+void ReadObjectMetaData(
+    const std::filesystem::path &path,
+    const std::function<void(const ObjectMetaData &)> &callback,
+    std::optional<MarkerETag> *marker = nullptr);
+
+// A snapshot is a metadata file built by ros3fs-index. `location` is a local
+// path or an S3 object such as s3://BUCKET/KEY.
+bool IsS3Location(const std::string &location);
+void DownloadSnapshot(const std::string &endpoint, const std::string &location,
+                      const std::filesystem::path &path);
+void UploadSnapshot(const std::string &endpoint,
+                    const std::filesystem::path &path,
+                    const std::string &location);
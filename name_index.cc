@@ -0,0 +1,117 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "name_index.h"
+
+#include <algorithm>
+#include <fnmatch.h>
+#include <string_view>
+
+namespace {
+
+uint32_t Trigram(const std::string_view s, const size_t i) {
+  return static_cast<uint8_t>(s[i]) << 16 |
+         static_cast<uint8_t>(s[i + 1]) << 8 | static_cast<uint8_t>(s[i + 2]);
+}
+
+std::string_view Name(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  return slash == std::string::npos ? std::string_view(path)
+                                    : std::string_view(path).substr(slash + 1);
+}
+
+// Returns runs of characters which must appear as is in names matching
+// `glob`.
+std::vector<std::string> LiteralParts(const std::string &glob) {
+  std::vector<std::string> parts(1);
+  for (size_t i = 0; i < glob.size(); i++) {
+    const char c = glob[i];
+    if (c == '*' || c == '?') {
+      parts.emplace_back();
+    } else if (c == '[') {
+      // Skip a bracket expression. ']' right after '[' or '[!' is a member.
+      size_t j = i + 1;
+      if (j < glob.size() && (glob[j] == '!' || glob[j] == '^')) {
+        j++;
+      }
+      if (j < glob.size() && glob[j] == ']') {
+        j++;
+      }
+      while (j < glob.size() && glob[j] != ']') {
+        j++;
+      }
+      if (j == glob.size()) {
+        // Unterminated '[' matches itself.
+        parts.back().push_back(c);
+        continue;
+      }
+      i = j;
+      parts.emplace_back();
+    } else if (c == '\\' && i + 1 < glob.size()) {
+      parts.back().push_back(glob[++i]);
+    } else {
+      parts.back().push_back(c);
+    }
+  }
+  return parts;
+}
+
+} // namespace
+
+// Cautions: This function is not thread safe.
+void NameIndex::Add(const std::string &path) {
+  const uint32_t id = paths_.size();
+  paths_.emplace_back(path);
+
+  const std::string_view name = Name(paths_.back());
+  for (size_t i = 0; i + 3 <= name.size(); i++) {
+    std::vector<uint32_t> &ids = trigrams_[Trigram(name, i)];
+    if (ids.empty() || ids.back() != id) {
+      ids.push_back(id);
+    }
+  }
+}
+
+std::vector<std::string> NameIndex::Query(const std::string &glob) const {
+  std::vector<uint32_t> candidates;
+  bool all = true;
+  for (const auto &part : LiteralParts(glob)) {
+    for (size_t i = 0; i + 3 <= part.size(); i++) {
+      const auto it = trigrams_.find(Trigram(part, i));
+      if (it == trigrams_.end()) {
+        return {};
+      }
+      if (all) {
+        candidates = it->second;
+        all = false;
+      } else {
+        std::vector<uint32_t> intersection;
+        std::set_intersection(candidates.begin(), candidates.end(),
+                              it->second.begin(), it->second.end(),
+                              std::back_inserter(intersection));
+        candidates.swap(intersection);
+      }
+      if (candidates.empty()) {
+        return {};
+      }
+    }
+  }
+
+  std::vector<std::string> result;
+  const auto match = [&](const uint32_t id) {
+    const std::string name(Name(paths_[id]));
+    if (fnmatch(glob.c_str(), name.c_str(), 0) == 0) {
+      result.emplace_back(paths_[id]);
+    }
+  };
+  if (all) {
+    for (uint32_t id = 0; id < paths_.size(); id++) {
+      match(id);
+    }
+  } else {
+    for (const uint32_t id : candidates) {
+      match(id);
+    }
+  }
+  return result;
+}
@@ -0,0 +1,27 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Trigram index over file names of objects. Query matches a glob against
+// the last component of each path like `find -name`. Only names which
+// contain all trigrams in the literal parts of the glob are checked with
+// fnmatch(3).
+class NameIndex {
+public:
+  // Cautions: This function is not thread safe.
+  void Add(const std::string &path);
+  // Returns matching paths in the order they were added.
+  std::vector<std::string> Query(const std::string &glob) const;
+  size_t size() const { return paths_.size(); }
+
+private:
+  std::vector<std::string> paths_;
+  // Trigram to sorted indices in paths_.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams_;
+};
@@ -0,0 +1,66 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "name_index.h"
+#include "log.h"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+using Paths = std::vector<std::string>;
+
+NameIndex MakeIndex() {
+  NameIndex index;
+  for (const char *p :
+       {"/a/foo.jpg", "/b/bar.JPG", "/c/[x].txt", "/d/ab", "/e/a*b",
+        "/f/foo.jpg.bak", "/dir.jpg/x", "/g/.hidden", "/h/xb"}) {
+    index.Add(p);
+  }
+  return index;
+}
+
+void CheckQuery(const NameIndex &index, const std::string &glob,
+                const Paths &expected) {
+  const Paths actual = index.Query(glob);
+  CHECK(actual == expected) << "Unexpected result of " << glob;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  const NameIndex index = MakeIndex();
+  CHECK_EQ(index.size(), 9u);
+
+  // Only the last component of paths is matched, case sensitively.
+  CheckQuery(index, "*.jpg", {"/a/foo.jpg"});
+  CheckQuery(index, "*.JPG", {"/b/bar.JPG"});
+  CheckQuery(index, "foo*", {"/a/foo.jpg", "/f/foo.jpg.bak"});
+  CheckQuery(index, "*",
+             {"/a/foo.jpg", "/b/bar.JPG", "/c/[x].txt", "/d/ab", "/e/a*b",
+              "/f/foo.jpg.bak", "/dir.jpg/x", "/g/.hidden", "/h/xb"});
+  CheckQuery(index, "x", {"/dir.jpg/x"});
+
+  // Literal parts shorter than a trigram check all names.
+  CheckQuery(index, "ab", {"/d/ab"});
+  CheckQuery(index, "?b", {"/d/ab", "/h/xb"});
+  CheckQuery(index, ".*", {"/g/.hidden"});
+
+  // Bracket expressions are not literal, and ']' right after '[' is a member.
+  CheckQuery(index, "[!x]b", {"/d/ab"});
+  CheckQuery(index, "[[]x].txt", {"/c/[x].txt"});
+  CheckQuery(index, "[]x]b", {"/h/xb"});
+
+  // An escaped '*' is literal.
+  CheckQuery(index, "a\\*b", {"/e/a*b"});
+
+  // Trigrams which no name has.
+  CheckQuery(index, "*.png", {});
+  CheckQuery(index, "foo*.png", {});
+  CheckQuery(index, "", {});
+
+  LOG(INFO) << "name_index_test passed";
+  return 0;
+}
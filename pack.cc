@@ -0,0 +1,299 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "pack.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+const std::string kSegmentPrefix = "segment_";
+
+std::filesystem::path SegmentPath(const std::filesystem::path &dir,
+                                  const uint64_t id) {
+  return dir / (kSegmentPrefix + std::to_string(id));
+}
+
+} // namespace
+
+PackSegment::~PackSegment() { close(fd); }
+
+PackStore::PackStore(const std::filesystem::path &dir,
+                     const uint64_t segment_size, const uint64_t max_bytes)
+    : dir_(dir), segment_size_(segment_size), max_bytes_(max_bytes) {
+  std::filesystem::create_directories(dir_);
+
+  std::vector<std::pair<uint64_t, std::filesystem::path>> files;
+  for (const auto &entry : std::filesystem::directory_iterator(dir_)) {
+    const std::string filename = entry.path().filename().string();
+    if (!filename.starts_with(kSegmentPrefix)) {
+      std::filesystem::remove_all(entry.path());
+      continue;
+    }
+    files.emplace_back(std::stoull(filename.substr(kSegmentPrefix.size())),
+                       entry.path());
+  }
+  std::sort(files.begin(), files.end());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &[id, path] : files) {
+    LoadSegmentLocked(id, path);
+  }
+  LOG(INFO) << "PackStore initialized with " << LOG_KEY(dir_)
+            << LOG_KEY(segments_.size()) << LOG_KEY(index_.size())
+            << LOG_KEY(total_bytes_);
+}
+
+off_t PackStore::ScanSegment(
+    const int fd, const uint64_t size,
+    const std::function<void(const std::string &, const Header &, off_t)>
+        &visitor) {
+  off_t offset = 0;
+  while (offset + sizeof(Header) <= size) {
+    Header header;
+    if (pread(fd, &header, sizeof(header), offset) != sizeof(header) ||
+        header.magic != kMagic) {
+      break;
+    }
+    const off_t data_offset = offset + sizeof(Header) + header.path_size;
+    if (data_offset + header.data_size > size) {
+      break;
+    }
+    std::string path(header.path_size, '\0');
+    if (pread(fd, path.data(), path.size(), offset + sizeof(Header)) !=
+        static_cast<ssize_t>(path.size())) {
+      break;
+    }
+    visitor(path, header, data_offset);
+    offset = data_offset + header.data_size;
+  }
+  return offset;
+}
+
+// Cautions: This function is not thread safe.
+void PackStore::LoadSegmentLocked(const uint64_t id,
+                                  const std::filesystem::path &path) {
+  const int fd = open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to open " << path << ". Remove it.";
+    std::filesystem::remove(path);
+    return;
+  }
+  auto segment = std::make_shared<PackSegment>(id, path, fd);
+
+  const off_t end = ScanSegment(
+      fd, std::filesystem::file_size(path),
+      [&](const std::string &p, const Header &header, const off_t offset) {
+        const auto it = index_.find(p);
+        if (it != index_.end()) {
+          it->second.segment->live_bytes -= it->second.size;
+        }
+        index_[p] = Entry{.segment = segment,
+                          .offset = offset,
+                          .size = header.data_size,
+                          .unix_time_millis = header.unix_time_millis};
+        segment->live_bytes += header.data_size;
+      });
+  // Drop a record which was being written when the process stopped.
+  if (ftruncate(fd, end) != 0) {
+    PLOG(WARNING) << "Failed to truncate " << path;
+  }
+  segment->size = end;
+  total_bytes_ += end;
+  segments_.push_back(segment);
+  next_segment_id_ = std::max(next_segment_id_, id + 1);
+}
+
+std::optional<PackStore::Location>
+PackStore::Find(const std::string &path, const uint64_t size,
+                const int64_t unix_time_millis) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(path);
+  if (it == index_.end() || it->second.size != size ||
+      it->second.unix_time_millis != unix_time_millis) {
+    return std::nullopt;
+  }
+  return Location{.segment = it->second.segment,
+                  .offset = it->second.offset,
+                  .size = it->second.size};
+}
+
+int PackStore::Append(const std::string &path, const int64_t unix_time_millis,
+                      const uint8_t *data, const size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return AppendLocked(path, unix_time_millis, data, size);
+}
+
+// Cautions: This function is not thread safe.
+int PackStore::AppendLocked(const std::string &path,
+                            const int64_t unix_time_millis, const uint8_t *data,
+                            const size_t size) {
+  const uint64_t record_size = sizeof(Header) + path.size() + size;
+  if (segments_.empty() ||
+      (segments_.back()->size > 0 &&
+       segments_.back()->size + record_size > segment_size_)) {
+    const int r = NewSegmentLocked();
+    if (r < 0) {
+      return r;
+    }
+  }
+  const std::shared_ptr<PackSegment> &segment = segments_.back();
+
+  Header header{.magic = kMagic,
+                .path_size = static_cast<uint32_t>(path.size()),
+                .data_size = size,
+                .unix_time_millis = unix_time_millis};
+  struct iovec iov[3] = {
+      {.iov_base = &header, .iov_len = sizeof(header)},
+      {.iov_base = const_cast<char *>(path.data()), .iov_len = path.size()},
+      {.iov_base = const_cast<uint8_t *>(data), .iov_len = size}};
+  const ssize_t r = pwritev(segment->fd, iov, 3, segment->size);
+  if (r != static_cast<ssize_t>(record_size)) {
+    const int err = r < 0 ? errno : EIO;
+    LOG(ERROR) << "Failed to append " << path << " to " << segment->path << ": "
+               << strerror(err);
+    // The next append overwrites the partial record.
+    return -err;
+  }
+
+  const auto it = index_.find(path);
+  if (it != index_.end()) {
+    it->second.segment->live_bytes -= it->second.size;
+  }
+  index_[path] = Entry{.segment = segment,
+                       .offset = static_cast<off_t>(segment->size +
+                                                    sizeof(Header) +
+                                                    path.size()),
+                       .size = size,
+                       .unix_time_millis = unix_time_millis};
+  segment->size += record_size;
+  segment->live_bytes += size;
+  total_bytes_ += record_size;
+  return 0;
+}
+
+// Cautions: This function is not thread safe.
+int PackStore::NewSegmentLocked() {
+  const uint64_t id = next_segment_id_++;
+  const std::filesystem::path path = SegmentPath(dir_, id);
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    const int err = errno;
+    PLOG(ERROR) << "Failed to create " << path;
+    return -err;
+  }
+  segments_.push_back(std::make_shared<PackSegment>(id, path, fd));
+  EvictLocked();
+  return 0;
+}
+
+// Cautions: This function is not thread safe. Removes `segment` and all
+// records in it from the index. Readers holding the segment can still read
+// it.
+void PackStore::DropSegmentLocked(
+    const std::shared_ptr<PackSegment> &segment) {
+  ScanSegment(segment->fd, segment->size,
+              [&](const std::string &p, const Header &, const off_t offset) {
+                const auto it = index_.find(p);
+                if (it != index_.end() && it->second.segment == segment &&
+                    it->second.offset == offset) {
+                  index_.erase(it);
+                }
+              });
+  total_bytes_ -= segment->size;
+  std::filesystem::remove(segment->path);
+  segments_.remove(segment);
+}
+
+// Cautions: This function is not thread safe. Removes the oldest sealed
+// segments until the total size fits in max_bytes_.
+void PackStore::EvictLocked() {
+  while (max_bytes_ > 0 && total_bytes_ > max_bytes_ && segments_.size() > 1) {
+    const std::shared_ptr<PackSegment> oldest = segments_.front();
+    LOG(INFO) << "Evict " << oldest->path << LOG_KEY(total_bytes_)
+              << LOG_KEY(max_bytes_);
+    DropSegmentLocked(oldest);
+  }
+}
+
+void PackStore::Remove(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(path);
+  if (it == index_.end()) {
+    return;
+  }
+  it->second.segment->live_bytes -= it->second.size;
+  index_.erase(it);
+}
+
+void PackStore::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  index_.clear();
+  for (const auto &segment : segments_) {
+    std::filesystem::remove(segment->path);
+  }
+  segments_.clear();
+  total_bytes_ = 0;
+}
+
+void PackStore::Compact() {
+  struct Target {
+    std::shared_ptr<PackSegment> segment;
+    // Copied with mutex_ held because appends and removals change them.
+    uint64_t live_bytes;
+    uint64_t size;
+  };
+  std::vector<Target> targets;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &segment : segments_) {
+      if (segment != segments_.back() &&
+          segment->live_bytes * 2 < segment->size) {
+        targets.push_back(Target{.segment = segment,
+                                 .live_bytes = segment->live_bytes,
+                                 .size = segment->size});
+      }
+    }
+  }
+
+  for (const Target &target : targets) {
+    const std::shared_ptr<PackSegment> &segment = target.segment;
+    LOG(INFO) << "Compact " << segment->path << LOG_KEY(target.live_bytes)
+              << LOG_KEY(target.size);
+    std::vector<uint8_t> data;
+    ScanSegment(
+        segment->fd, target.size,
+        [&](const std::string &p, const Header &header, const off_t offset) {
+          data.resize(header.data_size);
+          if (pread(segment->fd, data.data(), data.size(), offset) !=
+              static_cast<ssize_t>(data.size())) {
+            return;
+          }
+
+          // Critical section start
+          std::lock_guard<std::mutex> lock(mutex_);
+          const auto it = index_.find(p);
+          if (it != index_.end() && it->second.segment == segment &&
+              it->second.offset == offset) {
+            AppendLocked(p, header.unix_time_millis, data.data(), data.size());
+          }
+          // Critical section end
+        });
+
+    // Critical section start
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The segment may be evicted while moving records.
+    if (std::find(segments_.begin(), segments_.end(), segment) !=
+        segments_.end()) {
+      DropSegmentLocked(segment);
+    }
+    // Critical section end
+  }
+}
@@ -0,0 +1,117 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+// An append-only file which holds many small objects. The fd is closed when
+// the last reference is dropped, so readers can keep using a segment after it
+// is compacted or evicted.
+struct PackSegment {
+  PackSegment(const uint64_t id, const std::filesystem::path &path,
+              const int fd)
+      : id(id), path(path), fd(fd) {}
+  ~PackSegment();
+  PackSegment(PackSegment const &) = delete;
+  void operator=(PackSegment const &) = delete;
+
+  const uint64_t id;
+  const std::filesystem::path path;
+  const int fd;
+  // You must get PackStore::mutex_ before accessing the members below.
+  uint64_t size = 0;
+  uint64_t live_bytes = 0;
+};
+
+// Stores small objects in large pack segments instead of one cache file per
+// object. Each record in a segment is a header, the path of the object and
+// its contents. The index from paths to records is kept in memory and rebuilt
+// by scanning segments at startup.
+//
+// All functions are thread safe.
+class PackStore {
+public:
+  struct Location {
+    std::shared_ptr<PackSegment> segment;
+    // Offset of the contents in the segment.
+    off_t offset;
+    uint64_t size;
+  };
+
+  // `max_bytes` = 0 means no limit.
+  PackStore(const std::filesystem::path &dir, const uint64_t segment_size,
+            const uint64_t max_bytes);
+  PackStore(PackStore const &) = delete;
+  void operator=(PackStore const &) = delete;
+
+  std::filesystem::path dir() const { return dir_; }
+
+  // Returns the record of `path` only when it was stored for the object with
+  // `size` and `unix_time_millis`. Records of older versions of objects may
+  // remain in segments written before a restart.
+  std::optional<Location> Find(const std::string &path, const uint64_t size,
+                               const int64_t unix_time_millis);
+  // Appends `data` as the contents of `path`. Returns 0 or -errno.
+  int Append(const std::string &path, const int64_t unix_time_millis,
+             const uint8_t *data, const size_t size);
+  void Remove(const std::string &path);
+  // Removes all objects and segments.
+  void Clear();
+  // Moves live records out of sealed segments whose live bytes are less than
+  // half of their size and removes those segments.
+  void Compact();
+
+private:
+  struct Header {
+    uint32_t magic;
+    uint32_t path_size;
+    uint64_t data_size;
+    int64_t unix_time_millis;
+  };
+  static constexpr uint32_t kMagic = 0x4b415052; // "RPAK"
+
+  struct Entry {
+    std::shared_ptr<PackSegment> segment;
+    off_t offset;
+    uint64_t size;
+    int64_t unix_time_millis;
+  };
+
+  // Calls `visitor` with the path, header and offset of contents of each
+  // record in `segment` and returns the end of the last complete record.
+  static off_t ScanSegment(
+      const int fd, const uint64_t size,
+      const std::function<void(const std::string &, const Header &, off_t)>
+          &visitor);
+
+  // Cautions: These functions are not thread safe.
+  void LoadSegmentLocked(const uint64_t id, const std::filesystem::path &path);
+  int AppendLocked(const std::string &path, const int64_t unix_time_millis,
+                   const uint8_t *data, const size_t size);
+  int NewSegmentLocked();
+  void DropSegmentLocked(const std::shared_ptr<PackSegment> &segment);
+  void EvictLocked();
+
+  const std::filesystem::path dir_;
+  const uint64_t segment_size_;
+  const uint64_t max_bytes_;
+
+  // You must get mutex_ before accessing the members below.
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> index_;
+  // Ordered from the oldest. The last one is the active segment.
+  std::list<std::shared_ptr<PackSegment>> segments_;
+  uint64_t next_segment_id_ = 0;
+  uint64_t total_bytes_ = 0;
+};
@@ -0,0 +1,165 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "pack.h"
+#include "log.h"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+
+namespace {
+
+// Small enough that a few objects fill a segment.
+constexpr uint64_t kSegmentSize = 512;
+
+std::string Contents(const int i) {
+  return std::string(40 + i % 7, static_cast<char>('a' + i % 26));
+}
+
+int Append(PackStore &store, const std::string &path, const int64_t time,
+           const std::string &data) {
+  return store.Append(path, time,
+                      reinterpret_cast<const uint8_t *>(data.data()),
+                      data.size());
+}
+
+std::string Read(const PackStore::Location &location) {
+  std::string data(location.size, '\0');
+  CHECK_EQ(pread(location.segment->fd, data.data(), data.size(),
+                 location.offset),
+           static_cast<ssize_t>(data.size()));
+  return data;
+}
+
+void CheckFound(PackStore &store, const std::string &path, const int64_t time,
+                const std::string &data) {
+  const auto location = store.Find(path, data.size(), time);
+  CHECK(location.has_value()) << path << " is not found";
+  CHECK_EQ(Read(*location), data) << "Contents of " << path << " differ";
+}
+
+size_t NumSegments(const std::filesystem::path &dir) {
+  size_t n = 0;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    (void)entry;
+    n++;
+  }
+  return n;
+}
+
+void TestFind(const std::filesystem::path &dir) {
+  PackStore store(dir, kSegmentSize, 0);
+  for (int i = 0; i < 20; i++) {
+    CHECK_EQ(Append(store, "/" + std::to_string(i), i, Contents(i)), 0);
+  }
+  CHECK_GT(NumSegments(dir), 1u);
+  for (int i = 0; i < 20; i++) {
+    CheckFound(store, "/" + std::to_string(i), i, Contents(i));
+  }
+
+  // Other versions and paths miss.
+  CHECK(!store.Find("/0", Contents(0).size(), 1).has_value());
+  CHECK(!store.Find("/0", Contents(0).size() + 1, 0).has_value());
+  CHECK(!store.Find("/20", Contents(20).size(), 20).has_value());
+
+  // A new version replaces the old one.
+  CHECK_EQ(Append(store, "/0", 100, "new"), 0);
+  CheckFound(store, "/0", 100, "new");
+  CHECK(!store.Find("/0", Contents(0).size(), 0).has_value());
+
+  store.Remove("/1");
+  CHECK(!store.Find("/1", Contents(1).size(), 1).has_value());
+}
+
+// Segments are scanned at startup. A record which was being written when the
+// process stopped is dropped.
+void TestReload(const std::filesystem::path &dir) {
+  {
+    PackStore store(dir, kSegmentSize, 0);
+    CHECK_EQ(Append(store, "/a", 1, "old"), 0);
+    CHECK_EQ(Append(store, "/b", 2, "bbb"), 0);
+    CHECK_EQ(Append(store, "/a", 3, "new"), 0);
+  }
+  CHECK_EQ(NumSegments(dir), 1u);
+  const std::filesystem::path last =
+      std::filesystem::directory_iterator(dir)->path();
+  const uintmax_t size = std::filesystem::file_size(last);
+  {
+    const int fd = open(last.c_str(), O_WRONLY | O_APPEND);
+    CHECK_GE(fd, 0);
+    CHECK_EQ(write(fd, "RPAK", 4), 4);
+    close(fd);
+  }
+
+  PackStore store(dir, kSegmentSize, 0);
+  CheckFound(store, "/a", 3, "new");
+  CheckFound(store, "/b", 2, "bbb");
+  CHECK(!store.Find("/a", 3, 1).has_value());
+  CHECK_EQ(std::filesystem::file_size(last), size);
+}
+
+// Live records of sparse sealed segments move to the active segment.
+void TestCompact(const std::filesystem::path &dir) {
+  PackStore store(dir, kSegmentSize, 0);
+  for (int i = 0; i < 40; i++) {
+    CHECK_EQ(Append(store, "/" + std::to_string(i), i, Contents(i)), 0);
+  }
+  const size_t n_segments = NumSegments(dir);
+  for (int i = 0; i < 40; i++) {
+    if (i % 4 != 0) {
+      store.Remove("/" + std::to_string(i));
+    }
+  }
+  // Readers of a compacted segment keep reading it.
+  const auto held = store.Find("/0", Contents(0).size(), 0);
+  CHECK(held.has_value());
+
+  store.Compact();
+  CHECK_LT(NumSegments(dir), n_segments);
+  CHECK_EQ(Read(*held), Contents(0));
+  for (int i = 0; i < 40; i += 4) {
+    CheckFound(store, "/" + std::to_string(i), i, Contents(i));
+  }
+
+  // Moved records survive a restart.
+  PackStore reloaded(dir, kSegmentSize, 0);
+  for (int i = 0; i < 40; i += 4) {
+    CheckFound(reloaded, "/" + std::to_string(i), i, Contents(i));
+  }
+}
+
+// The oldest segments are evicted over max_bytes.
+void TestEvict(const std::filesystem::path &dir) {
+  PackStore store(dir, kSegmentSize, kSegmentSize * 2);
+  for (int i = 0; i < 40; i++) {
+    CHECK_EQ(Append(store, "/" + std::to_string(i), i, Contents(i)), 0);
+  }
+  CHECK_LE(NumSegments(dir), 3u);
+  CHECK(!store.Find("/0", Contents(0).size(), 0).has_value());
+  CheckFound(store, "/39", 39, Contents(39));
+
+  store.Clear();
+  CHECK_EQ(NumSegments(dir), 0u);
+  CHECK(!store.Find("/39", Contents(39).size(), 39).has_value());
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  char tmpl[] = "/tmp/ros3fs_pack_test_XXXXXX";
+  CHECK(mkdtemp(tmpl) != nullptr);
+  const std::filesystem::path root(tmpl);
+
+  TestFind(root / "find");
+  TestReload(root / "reload");
+  TestCompact(root / "compact");
+  TestEvict(root / "evict");
+
+  std::filesystem::remove_all(root);
+  LOG(INFO) << "pack_test passed";
+  return 0;
+}
@@ -0,0 +1,88 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "path_index.h"
+#include "xxh3.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+// The table uses the lower bits of `low` and blocks of the filter use the
+// upper bits of `high`. Bits in a block come from the rest by double hashing.
+uint32_t ProbeBit(const uint64_t low, const uint64_t high, const int i) {
+  const uint32_t h1 = low >> 32;
+  const uint32_t h2 = static_cast<uint32_t>(high) | 1;
+  return (h1 + i * h2) & 511;
+}
+
+} // namespace
+
+PathIndex::PathIndex(
+    std::vector<std::pair<std::string, FileMetaData>> entries) {
+  // Keep the load factor at most 1/2 so that probe sequences stay short.
+  const uint64_t capacity =
+      std::bit_ceil(std::max<uint64_t>(entries.size() * 2, 16));
+  slots_.assign(capacity, Slot{.low = 0, .high = 0, .meta = kEmpty});
+  mask_ = capacity - 1;
+  // About 10 bits per path gives about 1% false positives.
+  filter_.resize(std::max<uint64_t>((entries.size() * 10 + 511) / 512, 1));
+  metas_.reserve(entries.size());
+
+  for (auto &[path, meta] : entries) {
+    const auto [low, high] = GetXXH3Bits(path);
+    uint64_t i = low & mask_;
+    while (slots_[i].meta != kEmpty &&
+           (slots_[i].low != low || slots_[i].high != high)) {
+      i = (i + 1) & mask_;
+    }
+    if (slots_[i].meta == kEmpty) {
+      slots_[i] = Slot{.low = low,
+                       .high = high,
+                       .meta = static_cast<uint32_t>(metas_.size())};
+      metas_.emplace_back(std::move(meta));
+      AddToFilter(low, high);
+    } else {
+      metas_[slots_[i].meta] = std::move(meta);
+    }
+  }
+}
+
+size_t PathIndex::BlockIndex(const uint64_t high) const {
+  // Multiply and shift instead of modulo to pick a block.
+  return (static_cast<unsigned __int128>(high) * filter_.size()) >> 64;
+}
+
+void PathIndex::AddToFilter(const uint64_t low, const uint64_t high) {
+  Block &block = filter_[BlockIndex(high)];
+  for (int i = 0; i < kNumProbes; i++) {
+    const uint32_t bit = ProbeBit(low, high, i);
+    block.words[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+}
+
+bool PathIndex::MayContain(const uint64_t low, const uint64_t high) const {
+  const Block &block = filter_[BlockIndex(high)];
+  for (int i = 0; i < kNumProbes; i++) {
+    const uint32_t bit = ProbeBit(low, high, i);
+    if ((block.words[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const FileMetaData *PathIndex::Find(const std::string &path) const {
+  const auto [low, high] = GetXXH3Bits(path);
+  if (!MayContain(low, high)) {
+    return nullptr;
+  }
+  for (uint64_t i = low & mask_; slots_[i].meta != kEmpty;
+       i = (i + 1) & mask_) {
+    if (slots_[i].low == low && slots_[i].high == high) {
+      return &metas_[slots_[i].meta];
+    }
+  }
+  return nullptr;
+}
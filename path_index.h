@@ -0,0 +1,54 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "metadata.h"
+
+// Immutable index from full paths to their metadata. Paths are keyed by their
+// 128-bit XXH3 hashes in a flat open addressing table, and a blocked Bloom
+// filter in front of it answers most lookups of missing paths by reading one
+// cache line. Like cache file names, different paths are assumed to never
+// share a hash.
+//
+// Find is thread safe.
+class PathIndex {
+public:
+  explicit PathIndex(std::vector<std::pair<std::string, FileMetaData>> entries);
+  PathIndex(PathIndex const &) = delete;
+  void operator=(PathIndex const &) = delete;
+
+  // Returns nullptr when `path` is not in the index.
+  const FileMetaData *Find(const std::string &path) const;
+  size_t size() const { return metas_.size(); }
+
+private:
+  static constexpr uint32_t kEmpty = UINT32_MAX;
+  // Bits set in the filter for each path.
+  static constexpr int kNumProbes = 7;
+
+  struct Slot {
+    uint64_t low;
+    uint64_t high;
+    // Index in metas_ or kEmpty.
+    uint32_t meta;
+  };
+  // One cache line of the filter.
+  struct alignas(64) Block {
+    uint64_t words[8];
+  };
+
+  void AddToFilter(const uint64_t low, const uint64_t high);
+  bool MayContain(const uint64_t low, const uint64_t high) const;
+  size_t BlockIndex(const uint64_t high) const;
+
+  std::vector<FileMetaData> metas_;
+  std::vector<Slot> slots_;
+  uint64_t mask_ = 0;
+  std::vector<Block> filter_;
+};
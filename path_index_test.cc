@@ -0,0 +1,76 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "path_index.h"
+#include "log.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+FileMetaData File(const std::string &name, const uint64_t size) {
+  return FileMetaData{.name = name,
+                      .size = size,
+                      .type = FileType::kFile,
+                      .unix_time_millis = static_cast<int64_t>(size) * 1000};
+}
+
+void TestEmpty() {
+  const PathIndex index({});
+  CHECK_EQ(index.size(), 0u);
+  CHECK(index.Find("/") == nullptr);
+  CHECK(index.Find("/a") == nullptr);
+}
+
+// The filter must never hide a path in the index, and lookups of paths which
+// are not in the index must miss.
+void TestHitsAndMisses() {
+  constexpr int kNumPaths = 100000;
+  std::vector<std::pair<std::string, FileMetaData>> entries;
+  for (int i = 0; i < kNumPaths; i++) {
+    const std::string name = std::to_string(i);
+    entries.emplace_back("/dir" + std::to_string(i % 100) + "/" + name,
+                         File(name, i));
+  }
+  const PathIndex index(entries);
+  CHECK_EQ(index.size(), static_cast<size_t>(kNumPaths));
+
+  for (int i = 0; i < kNumPaths; i++) {
+    const std::string path =
+        "/dir" + std::to_string(i % 100) + "/" + std::to_string(i);
+    const FileMetaData *meta = index.Find(path);
+    CHECK(meta != nullptr) << "False negative for " << path;
+    CHECK_EQ(meta->name, std::to_string(i));
+    CHECK_EQ(meta->size, static_cast<uint64_t>(i));
+  }
+  for (int i = 0; i < kNumPaths; i++) {
+    // Same names in other directories and probes like Python imports.
+    const std::string dir = "/dir" + std::to_string((i + 1) % 100) + "/";
+    CHECK(index.Find(dir + std::to_string(i)) == nullptr);
+    CHECK(index.Find(dir + std::to_string(i) + ".py") == nullptr);
+  }
+  CHECK(index.Find("") == nullptr);
+  CHECK(index.Find("/dir0") == nullptr);
+  CHECK(index.Find("/dir0/") == nullptr);
+}
+
+void TestDuplicatePaths() {
+  const PathIndex index({{"/a", File("a", 1)}, {"/b", File("b", 2)},
+                         {"/a", File("a", 3)}});
+  CHECK_EQ(index.size(), 2u);
+  CHECK_EQ(index.Find("/a")->size, 3u);
+  CHECK_EQ(index.Find("/b")->size, 2u);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  TestEmpty();
+  TestHitsAndMisses();
+  TestDuplicatePaths();
+  LOG(INFO) << "path_index_test passed";
+  return 0;
+}
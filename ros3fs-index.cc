@@ -0,0 +1,133 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+// ros3fs-index lists a bucket once and writes a metadata snapshot. Mount the
+// bucket with --snapshot=<output> to skip listing the whole bucket at startup.
+
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include <aws/core/Aws.h>
+
+#include "log.h"
+#include "metadata.h"
+
+namespace {
+
+void show_help(const char *progname) {
+  std::cout << "usage: " << progname << " [options]" << std::endl
+            << "Example: " << progname
+            << " --endpoint=http://localhost:9878 --bucket_name=bucket1/ \\"
+            << std::endl
+            << "         --output=s3://bucket1/ros3fs-snapshot.json"
+            << std::endl
+            << std::endl
+            << "options. '=' is mandatory.:" << std::endl
+            << "--endpoint=URL         S3 endpoint (required)" << std::endl
+            << "--bucket_name=NAME     S3 bucket name (required)" << std::endl
+            << "--output=PATH          Local path or s3://BUCKET/KEY to write "
+               "the snapshot"
+            << std::endl
+            << "                       (required)" << std::endl
+            << "--list_max_keys=KEYS   The number of keys fetched in one "
+               "request (optional)"
+            << std::endl
+            << "                       Default value is 1000" << std::endl
+            << "--marker_key=KEY       Save the ETag of KEY with the snapshot "
+               "so that ros3fs"
+            << std::endl
+            << "                       --marker_key=KEY relists the bucket "
+               "only when it"
+            << std::endl
+            << "                       changed since (optional)" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+
+  std::string endpoint;
+  std::string bucket_name;
+  std::string output;
+  int list_max_keys = 1000;
+  std::string marker_key;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg(argv[i]);
+    if (arg == "-h" || arg == "--help") {
+      show_help(argv[0]);
+      exit(0);
+    } else if (arg.starts_with("--endpoint=")) {
+      endpoint = arg.substr(std::string("--endpoint=").size());
+    } else if (arg.starts_with("--bucket_name=")) {
+      bucket_name = arg.substr(std::string("--bucket_name=").size());
+    } else if (arg.starts_with("--output=")) {
+      output = arg.substr(std::string("--output=").size());
+    } else if (arg.starts_with("--list_max_keys=")) {
+      list_max_keys =
+          std::stoi(arg.substr(std::string("--list_max_keys=").size()));
+    } else if (arg.starts_with("--marker_key=")) {
+      marker_key = arg.substr(std::string("--marker_key=").size());
+    } else {
+      std::cerr << "Unknown option: " << arg << std::endl << std::endl;
+      show_help(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (endpoint == "" || bucket_name == "" || output == "") {
+    std::cerr << "--endpoint, --bucket_name and --output are required."
+              << std::endl
+              << std::endl;
+    show_help(argv[0]);
+    exit(1);
+  }
+
+  Aws::SDKOptions sdk_options;
+  Aws::InitAPI(sdk_options);
+  {
+    // Write to a local file first when the output is an S3 object.
+    const bool upload = IsS3Location(output);
+    const std::filesystem::path path =
+        upload ? std::filesystem::temp_directory_path() /
+                     ("ros3fs-index-" + std::to_string(getpid()) + ".json")
+               : std::filesystem::path(output);
+
+    size_t n_objects = 0;
+    RetryingS3Client client(endpoint, RetryOptions{});
+    ObjectMetaDataWriter writer(path);
+    CHECK(writer.IsOpen()) << "Failed to open " << path;
+    if (!marker_key.empty()) {
+      // Read the marker before listing so that changes made during the
+      // listing are seen by ros3fs.
+      std::string etag;
+      const int r = client.HeadObject(bucket_name, marker_key, &etag);
+      CHECK(r == 0 || r == -ENOENT) << "Failed to read " << marker_key;
+      writer.WriteMarker(MarkerETag{.key = marker_key, .etag = etag});
+    }
+    CHECK(FetchObjectMetaData(client, bucket_name, list_max_keys, "",
+                              [&](const std::vector<ObjectMetaData> &page) {
+                                for (const auto &md : page) {
+                                  writer.Write(md);
+                                }
+                                n_objects += page.size();
+                              }))
+        << "Failed to list " << bucket_name;
+    CHECK(writer.Close());
+    LOG(INFO) << "Wrote " << n_objects << " objects to " << path;
+
+    if (upload) {
+      UploadSnapshot(endpoint, path, output);
+      std::filesystem::remove(path);
+      LOG(INFO) << "Uploaded the snapshot to " << output;
+    }
+  }
+  Aws::ShutdownAPI(sdk_options);
+
+  return 0;
+}
@@ -1,13 +1,18 @@
 // ros3fs: Read Only S3 File System
 // Copyright (C) 2023 Akira Kawata
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <openssl/sha.h>
 #include <set>
 #include <sys/stat.h>
-#define FUSE_USE_VERSION 31
+// CMakeLists.txt defines FUSE_USE_VERSION depending on the version of libfuse.
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 32
+#endif
 
 #include <assert.h>
 #include <errno.h>
@@ -15,7 +20,9 @@
 #include <fuse.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <cstdio>
 #include <filesystem>
@@ -45,8 +52,39 @@ struct ROS3FSOptions {
   int clear_cache;
   int update_seconds;
   int list_max_keys;
+  int lazy_list;
+  int lazy_crawl;
+  int no_io_uring;
+  int no_splice;
+  int max_threads;
+  int max_idle_threads;
+  int clone_fd;
+  int max_read;
+  int max_background;
+  int congestion_threshold;
+  const char *snapshot;
+  int pack_threshold;
+  int no_pack;
+  int pack_segment_mb;
+  int pack_max_mb;
+  int name_index;
+  int no_path_index;
+  int entry_timeout;
+  int attr_timeout;
+  int max_attempts;
+  int request_deadline_ms;
+  int attempt_timeout_ms;
+  int hedge_percentile;
+  int range_mb;
+  const char *marker_key;
+  const char *change_log;
+  int sample_prefixes;
 } ROS3FSOptions;
 
+// Set by ROS3FSInit when libfuse can splice buffers returned by ROS3FSReadBuf
+// to /dev/fuse.
+bool splice_write = false;
+
 #define OPTION(t, p)                                                           \
   { t, offsetof(struct ROS3FSOptions, p), 1 }
 const struct fuse_opt option_spec[] = {
@@ -58,6 +96,33 @@ const struct fuse_opt option_spec[] = {
     OPTION("--clear_cache", clear_cache),
     OPTION("--update_seconds=%d", update_seconds),
     OPTION("--list-max-keys=%d", list_max_keys),
+    OPTION("--lazy_list", lazy_list),
+    OPTION("--lazy_crawl", lazy_crawl),
+    OPTION("--no_io_uring", no_io_uring),
+    OPTION("--no_splice", no_splice),
+    OPTION("--max_threads=%d", max_threads),
+    OPTION("--max_idle_threads=%d", max_idle_threads),
+    OPTION("--clone_fd", clone_fd),
+    OPTION("--max_read=%d", max_read),
+    OPTION("--max_background=%d", max_background),
+    OPTION("--congestion_threshold=%d", congestion_threshold),
+    OPTION("--snapshot=%s", snapshot),
+    OPTION("--pack_threshold=%d", pack_threshold),
+    OPTION("--no_pack", no_pack),
+    OPTION("--pack_segment_mb=%d", pack_segment_mb),
+    OPTION("--pack_max_mb=%d", pack_max_mb),
+    OPTION("--name_index", name_index),
+    OPTION("--no_path_index", no_path_index),
+    OPTION("--entry_timeout=%d", entry_timeout),
+    OPTION("--attr_timeout=%d", attr_timeout),
+    OPTION("--max_attempts=%d", max_attempts),
+    OPTION("--request_deadline_ms=%d", request_deadline_ms),
+    OPTION("--attempt_timeout_ms=%d", attempt_timeout_ms),
+    OPTION("--hedge_percentile=%d", hedge_percentile),
+    OPTION("--range_mb=%d", range_mb),
+    OPTION("--marker_key=%s", marker_key),
+    OPTION("--change_log=%s", change_log),
+    OPTION("--sample_prefixes", sample_prefixes),
     FUSE_OPT_END};
 
 void show_help(const char *progname) {
@@ -82,6 +147,152 @@ void show_help(const char *progname) {
          "(optional)"
       << std::endl
       << "                       Default value is 1000" << std::endl
+      << "--lazy_list            List a directory when it is looked up for "
+         "the first"
+      << std::endl
+      << "                       time instead of listing the whole bucket "
+         "at startup"
+      << std::endl
+      << "                       (optional)" << std::endl
+      << "--lazy_crawl           List remaining directories in background "
+         "with"
+      << std::endl
+      << "                       --lazy_list (optional)" << std::endl
+      << "--no_io_uring          Use pread/pwrite instead of io_uring for "
+         "cache files."
+      << std::endl
+      << "                       Reads spliced to /dev/fuse use neither "
+         "(optional)"
+      << std::endl
+      << "--no_splice            Copy data from cache files in user space "
+         "instead of"
+      << std::endl
+      << "                       splicing them to /dev/fuse (optional)"
+      << std::endl
+      << "--max_threads=N        Maximum number of worker threads (optional)"
+      << std::endl
+      << "                       Default value is 10. Needs libfuse 3.12 or "
+         "later."
+      << std::endl
+      << "--max_idle_threads=N   Maximum number of idle worker threads "
+         "(optional)"
+      << std::endl
+      << "--clone_fd             Use a separate /dev/fuse fd for each worker "
+         "thread"
+      << std::endl
+      << "                       (optional)" << std::endl
+      << "--max_read=BYTES       Maximum size of read requests (optional)"
+      << std::endl
+      << "--max_background=N     Maximum number of pending background "
+         "requests such"
+      << std::endl
+      << "                       as readahead (optional)" << std::endl
+      << "--congestion_threshold=N" << std::endl
+      << "                       Number of pending background requests at "
+         "which the"
+      << std::endl
+      << "                       kernel considers the filesystem congested "
+         "(optional)"
+      << std::endl
+      << "--snapshot=PATH        Metadata snapshot built by ros3fs-index. "
+         "A local path"
+      << std::endl
+      << "                       or s3://BUCKET/KEY. Used instead of listing "
+         "the bucket"
+      << std::endl
+      << "                       when cache_dir has no metadata (optional)"
+      << std::endl
+      << "--pack_threshold=BYTES Objects up to this size are stored in pack "
+         "segments"
+      << std::endl
+      << "                       instead of their own cache files. Default "
+         "is 65536"
+      << std::endl
+      << "                       and the maximum is 1048576 (optional)"
+      << std::endl
+      << "--no_pack              Store every object in its own cache file "
+         "(optional)"
+      << std::endl
+      << "--pack_segment_mb=MB   Size of one pack segment. Default is 64 "
+         "(optional)"
+      << std::endl
+      << "--pack_max_mb=MB       Maximum total size of pack segments. The "
+         "oldest"
+      << std::endl
+      << "                       segments are evicted over this. Default is "
+         "no limit"
+      << std::endl
+      << "                       (optional)" << std::endl
+      << "--name_index           Index names of files and serve "
+         "/.ros3fs/query/<glob>"
+      << std::endl
+      << "                       which lists paths of files whose names match "
+         "<glob>"
+      << std::endl
+      << "                       (optional)" << std::endl
+      << "--no_path_index        Look up attributes by walking the tree "
+         "instead of a"
+      << std::endl
+      << "                       hash index of full paths. Saves memory "
+         "(optional)"
+      << std::endl
+      << "--entry_timeout=SECS   Seconds the kernel caches names. Default is "
+         "1 (optional)"
+      << std::endl
+      << "--attr_timeout=SECS    Seconds the kernel caches attributes. "
+         "Default is 86400,"
+      << std::endl
+      << "                       or 1 with --lazy_list (optional)" << std::endl
+      << "--max_attempts=N       Maximum attempts of one S3 request "
+         "including retries."
+      << std::endl
+      << "                       Default is 5 (optional)" << std::endl
+      << "--request_deadline_ms=MS" << std::endl
+      << "                       Deadline of one S3 request including "
+         "retries. Default"
+      << std::endl
+      << "                       is 60000 (optional)" << std::endl
+      << "--attempt_timeout_ms=MS" << std::endl
+      << "                       Timeout of connecting and of a stalled "
+         "transfer in one"
+      << std::endl
+      << "                       attempt. Default is request_deadline_ms / "
+         "max_attempts"
+      << std::endl
+      << "                       (optional)" << std::endl
+      << "--hedge_percentile=P   Issue a duplicate GET when a GET is slower "
+         "than the P-th"
+      << std::endl
+      << "                       percentile of past GETs of similar sizes. "
+         "Default is 0"
+      << std::endl
+      << "                       which disables hedging (optional)"
+      << std::endl
+      << "--range_mb=MB          Size of ranged GETs to download objects. "
+         "Default is 8"
+      << std::endl
+      << "                       (optional)" << std::endl
+      << "--marker_key=KEY       Relist the bucket only when the ETag of KEY "
+         "changes"
+      << std::endl
+      << "                       instead of every update_seconds (optional)"
+      << std::endl
+      << "--change_log=PATH      Relist directories of keys appended to the "
+         "local file"
+      << std::endl
+      << "                       PATH one per line (optional)" << std::endl
+      << "--sample_prefixes      Compare the next page of each top level "
+         "directory"
+      << std::endl
+      << "                       with the metadata and relist directories "
+         "which differ."
+      << std::endl
+      << "                       A change is noticed within about (objects "
+         "in the"
+      << std::endl
+      << "                       directory / list_max_keys) * update_seconds "
+         "(optional)"
+      << std::endl
       << std::endl
       << "FUSE specific options:" << std::endl
       << "-d, -odebug" << std::endl
@@ -99,25 +310,61 @@ void show_help(const char *progname) {
       << std::endl
       << "    fuse_parse_cmdline()." << std::endl
       << "-s" << std::endl
-      << "    If this is specified then mt will be set to 0 on success. "
+      << "    Run the FUSE session loop in a single thread. Without this "
+         "flag,"
       << std::endl
-      << "    This flag indicates that the file system should be run "
+      << "    requests are handled by multiple worker threads. See "
+         "--max_threads,"
       << std::endl
-      << "    in multi-threaded mode. -s is currently ignored and mt will "
-         "always be 0."
-      << std::endl;
+      << "    --max_idle_threads and --clone_fd." << std::endl;
 }
 
 void *ROS3FSInit(struct fuse_conn_info *conn, struct fuse_config *cfg) {
-  (void)conn;
   cfg->kernel_cache = 1;
 
+  // Metadata changes only at refresh, and the refresh invalidates attributes
+  // and pages of changed paths. fuse_invalidate_path cannot drop names, so
+  // entry_timeout keeps the default so that added and removed names show up
+  // soon. In lazy listing mode, the refresh drops the whole tree without
+  // knowing what changed, so we keep the default timeouts.
+  constexpr double defaultAttrTimeout = 86400;
+  if (!ROS3FSOptions.lazy_list) {
+    cfg->attr_timeout = defaultAttrTimeout;
+  }
+  if (ROS3FSOptions.entry_timeout > 0) {
+    cfg->entry_timeout = ROS3FSOptions.entry_timeout;
+  }
+  if (ROS3FSOptions.attr_timeout > 0) {
+    cfg->attr_timeout = ROS3FSOptions.attr_timeout;
+  }
+
+  // Let libfuse splice pages of cache files returned by ROS3FSReadBuf to
+  // /dev/fuse.
+  if (!ROS3FSOptions.no_splice) {
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  }
+  splice_write = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+  if (ROS3FSOptions.max_read > 0) {
+    conn->max_read = ROS3FSOptions.max_read;
+  }
+  if (ROS3FSOptions.max_background > 0) {
+    conn->max_background = ROS3FSOptions.max_background;
+  }
+  if (ROS3FSOptions.congestion_threshold > 0) {
+    conn->congestion_threshold = ROS3FSOptions.congestion_threshold;
+  }
+  LOG(INFO) << "ROS3FSInit" << LOG_KEY(cfg->entry_timeout)
+            << LOG_KEY(cfg->attr_timeout) << LOG_KEY(conn->capable)
+            << LOG_KEY(conn->want) << LOG_KEY(conn->max_read)
+            << LOG_KEY(conn->max_background)
+            << LOG_KEY(conn->congestion_threshold);
+
   return NULL;
 }
 
 int ROS3FSGetattr(const char *path_c_str, struct stat *stbuf,
                   struct fuse_file_info *fi) {
-  LOG(INFO) << "ROS3FSGetattr" << LOG_KEY(path_c_str);
+  VLOG(1) << "ROS3FSGetattr" << LOG_KEY(path_c_str);
 
   (void)fi;
 
@@ -128,34 +375,35 @@ int ROS3FSGetattr(const char *path_c_str, struct stat *stbuf,
 
   const std::filesystem::path path(path_c_str);
 
-  const auto meta = ROS3FSContext::GetContext().GetAttr(path);
-  if (meta.has_value()) {
-    if (meta.value().type == FileType::kDirectory) {
+  FileMetaData meta;
+  const int r = ROS3FSContext::GetContext().GetAttr(path, &meta);
+  if (r == 0) {
+    if (meta.type == FileType::kDirectory) {
       stbuf->st_mode = S_IFDIR | 0444;
       stbuf->st_nlink = 2;
 
       // TODO: This is platform dependent.
-      stbuf->st_atime = meta.value().unix_time_millis / 1000;
-      stbuf->st_mtime = meta.value().unix_time_millis / 1000;
-      stbuf->st_ctime = meta.value().unix_time_millis / 1000;
+      stbuf->st_atime = meta.unix_time_millis / 1000;
+      stbuf->st_mtime = meta.unix_time_millis / 1000;
+      stbuf->st_ctime = meta.unix_time_millis / 1000;
 
-      LOG(INFO) << "ROS3FSGetattr: " << LOG_KEY(path) << " is a directory.";
+      VLOG(1) << "ROS3FSGetattr: " << LOG_KEY(path) << " is a directory.";
     } else {
       stbuf->st_mode = S_IFREG | 0444;
       stbuf->st_nlink = 1;
-      stbuf->st_size = meta.value().size;
+      stbuf->st_size = meta.size;
 
       // TODO: This is platform dependent.
-      stbuf->st_atime = meta.value().unix_time_millis / 1000;
-      stbuf->st_mtime = meta.value().unix_time_millis / 1000;
-      stbuf->st_ctime = meta.value().unix_time_millis / 1000;
+      stbuf->st_atime = meta.unix_time_millis / 1000;
+      stbuf->st_mtime = meta.unix_time_millis / 1000;
+      stbuf->st_ctime = meta.unix_time_millis / 1000;
 
-      LOG(INFO) << "ROS3FSGetattr: " << LOG_KEY(path) << " is a normal file.";
+      VLOG(1) << "ROS3FSGetattr: " << LOG_KEY(path) << " is a normal file.";
     }
     return 0;
   } else {
-    LOG(INFO) << "ROS3FSGetattr: " << LOG_KEY(path) << " does not exist.";
-    return -ENOENT;
+    VLOG(1) << "ROS3FSGetattr: " << LOG_KEY(path) << " does not exist.";
+    return r;
   }
 }
 
@@ -167,14 +415,19 @@ int ROS3FSReaddir(const char *path_c_str, void *buf, fuse_fill_dir_t filler,
   (void)flags;
 
   const std::filesystem::path path(path_c_str);
-  LOG(INFO) << "ROS3FSReaddir" << LOG_KEY(path);
+  VLOG(1) << "ROS3FSReaddir" << LOG_KEY(path);
+
+  std::vector<FileMetaData> metas;
+  const int r = ROS3FSContext::GetContext().ReadDirectory(path, &metas);
+  if (r < 0) {
+    return r;
+  }
 
   filler(buf, ".", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
   filler(buf, "..", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
 
-  const auto &metas = ROS3FSContext::GetContext().ReadDirectory(path);
   for (const auto &m : metas) {
-    LOG(INFO) << "ROS3FSReaddir: Found " << LOG_KEY(m.name) << " in "
+    VLOG(1) << "ROS3FSReaddir: Found " << LOG_KEY(m.name) << " in "
               << LOG_KEY(path);
     filler(buf, m.name.c_str(), NULL, 0, static_cast<fuse_fill_dir_flags>(0));
   }
@@ -183,14 +436,40 @@ int ROS3FSReaddir(const char *path_c_str, void *buf, fuse_fill_dir_t filler,
 }
 
 int ROS3FSOpen(const char *path, struct fuse_file_info *fi) {
-  LOG(INFO) << "ROS3FSOpen" << LOG_KEY(path);
+  VLOG(1) << "ROS3FSOpen" << LOG_KEY(path);
 
   if ((fi->flags & O_ACCMODE) != O_RDONLY) {
     LOG(WARNING) << "ROS3FSOpen: " << LOG_KEY(path) << " is not read only.";
     return -EACCES;
   }
 
-  fi->fh = 4;
+  if (ROS3FSContext::IsControlPath(path)) {
+    std::optional<std::string> contents =
+        ROS3FSContext::GetContext().ReadControlFile(path);
+    if (!contents.has_value()) {
+      return -ENOENT;
+    }
+    // Contents of control files change without notice.
+    fi->direct_io = 1;
+    fi->fh = reinterpret_cast<uint64_t>(new OpenedFile{
+        .path = path, .control = true, .contents = std::move(*contents)});
+    return 0;
+  }
+
+  fi->fh = reinterpret_cast<uint64_t>(new OpenedFile{
+      .path = path,
+      .cache_file = ROS3FSContext::GetContext().CacheFilePath(path)});
+
+  return 0;
+}
+
+int ROS3FSRelease(const char *path, struct fuse_file_info *fi) {
+  VLOG(1) << "ROS3FSRelease" << LOG_KEY(path);
+
+  OpenedFile *opened = reinterpret_cast<OpenedFile *>(fi->fh);
+  ROS3FSContext::GetContext().CloseFile(*opened);
+  delete opened;
+  fi->fh = 0;
 
   return 0;
 }
@@ -199,32 +478,173 @@ int ROS3FSRead(const char *path_c_str, char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
   const std::filesystem::path path(path_c_str);
 
-  LOG(INFO) << "ROS3FSRead" << LOG_KEY(path) << LOG_KEY(size)
+  VLOG(1) << "ROS3FSRead" << LOG_KEY(path) << LOG_KEY(size)
             << LOG_KEY(offset);
 
-  std::optional<FileMetaData> meta = ROS3FSContext::GetContext().GetAttr(path);
-  if (meta.has_value() && meta.value().type == FileType::kFile) {
-    const std::vector<uint8_t> d =
-        ROS3FSContext::GetContext().GetFileContents(path);
-    const auto n = std::min(size, d.size() - offset);
+  OpenedFile *opened = reinterpret_cast<OpenedFile *>(fi->fh);
+  if (opened->control) {
+    return ROS3FSContext::GetContext().ReadFile(*opened, buf, size, offset);
+  }
+
+  FileMetaData meta;
+  if (ROS3FSContext::GetContext().GetAttr(path, &meta) == 0 &&
+      meta.type == FileType::kFile) {
+    const ssize_t n =
+        ROS3FSContext::GetContext().ReadFile(*opened, buf, size, offset);
 
-    LOG(INFO) << "ROS3FSRead: " << LOG_KEY(path) << LOG_KEY(size)
+    VLOG(1) << "ROS3FSRead: " << LOG_KEY(path) << LOG_KEY(size)
               << LOG_KEY(offset) << LOG_KEY(n);
-    for (size_t i = 0; i < n; ++i) {
-      buf[i] = static_cast<char>(d[i + offset]);
-    }
     return n;
   }
 
   return 0;
 }
 
+// Returns a buffer pointing to the cache file instead of copying its contents
+// so that libfuse can splice them to the reader.
+int ROS3FSReadBuf(const char *path_c_str, struct fuse_bufvec **bufp,
+                  size_t size, off_t offset, struct fuse_file_info *fi) {
+  const std::filesystem::path path(path_c_str);
+
+  VLOG(1) << "ROS3FSReadBuf" << LOG_KEY(path) << LOG_KEY(size)
+            << LOG_KEY(offset);
+
+  OpenedFile *opened = reinterpret_cast<OpenedFile *>(fi->fh);
+
+  // libfuse releases this with free().
+  struct fuse_bufvec *src =
+      static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+  if (src == NULL) {
+    return -ENOMEM;
+  }
+
+  if (opened->control) {
+    // libfuse frees mem of a buffer which is not an fd, so give it a copy.
+    const size_t n =
+        static_cast<size_t>(offset) < opened->contents.size()
+            ? std::min(size, opened->contents.size() - offset)
+            : 0;
+    char *mem = static_cast<char *>(malloc(std::max<size_t>(n, 1)));
+    if (mem == NULL) {
+      free(src);
+      return -ENOMEM;
+    }
+    if (n > 0) {
+      memcpy(mem, opened->contents.data() + offset, n);
+    }
+    *src = FUSE_BUFVEC_INIT(n);
+    src->buf[0].mem = mem;
+    *bufp = src;
+    return 0;
+  }
+
+  // Like ROS3FSRead, a file removed by a refresh reads as empty.
+  FileMetaData meta;
+  if (ROS3FSContext::GetContext().GetAttr(path, &meta) != 0 ||
+      meta.type != FileType::kFile) {
+    *src = FUSE_BUFVEC_INIT(0);
+    *bufp = src;
+    return 0;
+  }
+
+  if (!splice_write) {
+    // libfuse would copy from the fd with pread(2). Read through CacheIO
+    // instead so that reads also use io_uring. libfuse frees mem.
+    char *mem = static_cast<char *>(malloc(size));
+    if (mem == NULL) {
+      free(src);
+      return -ENOMEM;
+    }
+    const ssize_t n =
+        ROS3FSContext::GetContext().ReadFile(*opened, mem, size, offset);
+    if (n < 0) {
+      free(mem);
+      free(src);
+      return n;
+    }
+    *src = FUSE_BUFVEC_INIT(static_cast<size_t>(n));
+    src->buf[0].mem = mem;
+    *bufp = src;
+    return 0;
+  }
+
+  const int fd = ROS3FSContext::GetContext().OpenCacheFile(*opened);
+  if (fd < 0) {
+    free(src);
+    return fd;
+  }
+  // The cache file may still be downloading.
+  const int r = ROS3FSContext::GetContext().WaitForData(*opened, size, offset);
+  if (r < 0) {
+    free(src);
+    return r;
+  }
+  src->count = 1;
+  src->idx = 0;
+  src->off = 0;
+  src->buf[0].size = opened->ReadSize(size, offset);
+  src->buf[0].flags =
+      static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  src->buf[0].mem = NULL;
+  src->buf[0].fd = fd;
+  src->buf[0].pos = opened->base + offset;
+  *bufp = src;
+
+  return 0;
+}
+
+// Forks like fuse_daemonize and returns the write end of a pipe in the child,
+// or -1 with `foreground`. Unlike fuse_daemonize, the parent waits until the
+// child mounts the bucket and calls FinishDaemonize. It exits with 1 when the
+// child dies before that, e.g. because listing the bucket failed.
+int StartDaemonize(const bool foreground) {
+  if (foreground) {
+    return -1;
+  }
+  int waiter[2];
+  PCHECK(pipe(waiter) == 0);
+  const pid_t pid = fork();
+  PCHECK(pid >= 0);
+  if (pid > 0) {
+    close(waiter[1]);
+    char completed = 0;
+    const ssize_t n = read(waiter[0], &completed, sizeof(completed));
+    _exit(n == sizeof(completed) && completed == 1 ? 0 : 1);
+  }
+  close(waiter[0]);
+  PCHECK(setsid() != -1);
+  return waiter[1];
+}
+
+// Detaches the child from the terminal and lets the parent exit. Errors until
+// here are still printed to the terminal.
+void FinishDaemonize(const int waiter) {
+  PCHECK(chdir("/") == 0);
+  if (waiter < 0) {
+    return;
+  }
+  const int nullfd = open("/dev/null", O_RDWR, 0);
+  if (nullfd != -1) {
+    dup2(nullfd, 0);
+    dup2(nullfd, 1);
+    dup2(nullfd, 2);
+    if (nullfd > 2) {
+      close(nullfd);
+    }
+  }
+  const char completed = 1;
+  PCHECK(write(waiter, &completed, sizeof(completed)) == sizeof(completed));
+  close(waiter);
+}
+
 const struct fuse_operations ozonefs_oper = {
     .getattr = ROS3FSGetattr,
     .open = ROS3FSOpen,
     .read = ROS3FSRead,
+    .release = ROS3FSRelease,
     .readdir = ROS3FSReaddir,
     .init = ROS3FSInit,
+    .read_buf = ROS3FSReadBuf,
 };
 } // namespace
 
@@ -241,6 +661,9 @@ int main(int argc, char *argv[]) {
   ROS3FSOptions.bucket_name = strdup("");
   ROS3FSOptions.endpoint = strdup("");
   ROS3FSOptions.cache_dir = strdup("");
+  ROS3FSOptions.snapshot = strdup("");
+  ROS3FSOptions.marker_key = strdup("");
+  ROS3FSOptions.change_log = strdup("");
 
   /* Parse ROS3FSOptions */
   if (fuse_opt_parse(&args, &ROS3FSOptions, option_spec, NULL) == -1)
@@ -280,13 +703,21 @@ int main(int argc, char *argv[]) {
   CHECK_NE(std::string(ROS3FSOptions.bucket_name), "");
   CHECK_NE(std::string(ROS3FSOptions.cache_dir), "");
 
-  std::filesystem::path cache_dir_root(ROS3FSOptions.cache_dir);
+  // Make paths absolute because FinishDaemonize changes the current
+  // directory.
+  std::filesystem::path cache_dir_root(
+      std::filesystem::absolute(ROS3FSOptions.cache_dir));
   std::filesystem::path cache_dir(
       cache_dir_root / GetSHA256(std::string(ROS3FSOptions.endpoint) +
                                  ROS3FSOptions.bucket_name));
   std::filesystem::create_directories(cache_dir_root);
   std::filesystem::create_directories(cache_dir);
 
+  const std::filesystem::path change_log =
+      std::string(ROS3FSOptions.change_log) == ""
+          ? std::filesystem::path()
+          : std::filesystem::absolute(ROS3FSOptions.change_log);
+
   const bool clear_cache = ROS3FSOptions.clear_cache;
 
   constexpr int defaultUpdateSeconds = 3600;
@@ -299,11 +730,148 @@ int main(int argc, char *argv[]) {
                                 ? ROS3FSOptions.list_max_keys
                                 : defaultListMaxKeys;
 
-  ROS3FSContext::InitContext(ROS3FSOptions.endpoint, ROS3FSOptions.bucket_name,
-                             update_seconds, list_max_keys, cache_dir,
-                             clear_cache);
+  constexpr int defaultPackThreshold = 64 * 1024;
+  const int pack_threshold =
+      ROS3FSOptions.no_pack
+          ? 0
+          : (ROS3FSOptions.pack_threshold > 0 ? ROS3FSOptions.pack_threshold
+                                              : defaultPackThreshold);
+
+  constexpr int defaultPackSegmentMB = 64;
+  const int pack_segment_mb = ROS3FSOptions.pack_segment_mb > 0
+                                  ? ROS3FSOptions.pack_segment_mb
+                                  : defaultPackSegmentMB;
+
+  RetryOptions retry_options;
+  if (ROS3FSOptions.max_attempts > 0) {
+    retry_options.max_attempts = ROS3FSOptions.max_attempts;
+  }
+  if (ROS3FSOptions.request_deadline_ms > 0) {
+    retry_options.deadline =
+        std::chrono::milliseconds(ROS3FSOptions.request_deadline_ms);
+  }
+  retry_options.attempt_timeout =
+      ROS3FSOptions.attempt_timeout_ms > 0
+          ? std::chrono::milliseconds(ROS3FSOptions.attempt_timeout_ms)
+          : retry_options.deadline / retry_options.max_attempts;
+  retry_options.hedge_percentile =
+      std::clamp(ROS3FSOptions.hedge_percentile, 0, 99);
+
+  constexpr int defaultRangeMB = 8;
+  const int range_mb =
+      ROS3FSOptions.range_mb > 0 ? ROS3FSOptions.range_mb : defaultRangeMB;
+
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    return 1;
+  }
+  if (opts.mountpoint == NULL) {
+    std::cerr << "<mountpoint> is not specified." << std::endl << std::endl;
+    show_help(argv[0]);
+    exit(1);
+  }
+
+  // The kernel also needs max_read as a mount option.
+  if (ROS3FSOptions.max_read > 0) {
+    const std::string max_read =
+        "-omax_read=" + std::to_string(ROS3FSOptions.max_read);
+    CHECK_EQ(fuse_opt_add_arg(&args, max_read.c_str()), 0);
+  }
+
+  // Without read_buf, libfuse falls back to read.
+  struct fuse_operations oper = ozonefs_oper;
+  if (ROS3FSOptions.no_splice) {
+    oper.read_buf = NULL;
+  }
+
+  // Threads do not survive fork(2), so fork before the context starts them.
+  const int waiter = StartDaemonize(opts.foreground);
+
+  struct fuse *fuse = fuse_new(&args, &oper, sizeof(oper), NULL);
+  if (fuse == NULL) {
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+
+  // List the bucket before mounting it so that nobody sees a mount which is
+  // not ready, and a failure leaves no dead mount behind.
+  ROS3FSContext::InitContext(ROS3FSContextOptions{
+      .endpoint = ROS3FSOptions.endpoint,
+      .bucket_name = ROS3FSOptions.bucket_name,
+      .update_seconds = update_seconds,
+      .list_max_keys = list_max_keys,
+      .cache_dir = cache_dir,
+      .clear_cache = clear_cache,
+      .lazy_list = ROS3FSOptions.lazy_list != 0,
+      .lazy_crawl = ROS3FSOptions.lazy_crawl != 0,
+      .use_io_uring = ROS3FSOptions.no_io_uring == 0,
+      .snapshot = ROS3FSOptions.snapshot,
+      .pack_threshold = static_cast<uint64_t>(pack_threshold),
+      .pack_segment_size = static_cast<uint64_t>(pack_segment_mb) << 20,
+      .pack_max_bytes =
+          static_cast<uint64_t>(std::max(ROS3FSOptions.pack_max_mb, 0)) << 20,
+      .name_index = ROS3FSOptions.name_index != 0,
+      .path_index = ROS3FSOptions.no_path_index == 0,
+      .invalidate_path =
+          [fuse](const std::filesystem::path &path) {
+            // -ENOENT means the kernel does not cache the path.
+            const int r = fuse_invalidate_path(fuse, path.c_str());
+            LOG_IF(WARNING, r != 0 && r != -ENOENT)
+                << "Failed to invalidate " << path << ": " << strerror(-r);
+          },
+      .retry = retry_options,
+      .range_size = static_cast<uint64_t>(range_mb) << 20,
+      .marker_key = ROS3FSOptions.marker_key,
+      .change_log = change_log,
+      .sample_prefixes = ROS3FSOptions.sample_prefixes != 0,
+  });
+
+  if (fuse_mount(fuse, opts.mountpoint) != 0) {
+    fuse_destroy(fuse);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+  FinishDaemonize(waiter);
+
+  struct fuse_session *se = fuse_get_session(fuse);
+  CHECK_EQ(fuse_set_signal_handlers(se), 0);
+
+  if (opts.singlethread) {
+    ret = fuse_loop(fuse);
+  } else {
+    const bool clone_fd = ROS3FSOptions.clone_fd || opts.clone_fd;
+    const unsigned int max_idle_threads =
+        ROS3FSOptions.max_idle_threads > 0 ? ROS3FSOptions.max_idle_threads
+                                           : opts.max_idle_threads;
+    LOG(INFO) << "Start multi-threaded loop" << LOG_KEY(clone_fd)
+              << LOG_KEY(max_idle_threads)
+              << LOG_KEY(ROS3FSOptions.max_threads);
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+    const unsigned int max_threads = ROS3FSOptions.max_threads > 0
+                                         ? ROS3FSOptions.max_threads
+                                         : opts.max_threads;
+    struct fuse_loop_config *config = fuse_loop_cfg_create();
+    fuse_loop_cfg_set_clone_fd(config, clone_fd);
+    fuse_loop_cfg_set_idle_threads(config, max_idle_threads);
+    fuse_loop_cfg_set_max_threads(config, max_threads);
+    ret = fuse_loop_mt(fuse, config);
+    fuse_loop_cfg_destroy(config);
+#else
+    LOG_IF(WARNING, ROS3FSOptions.max_threads > 0)
+        << "--max_threads needs libfuse 3.12 or later. Ignore it.";
+    struct fuse_loop_config config;
+    config.clone_fd = clone_fd;
+    config.max_idle_threads = max_idle_threads;
+    ret = fuse_loop_mt(fuse, &config);
+#endif
+  }
 
-  ret = fuse_main(args.argc, args.argv, &ozonefs_oper, NULL);
+  fuse_remove_signal_handlers(se);
+  fuse_unmount(fuse);
+  fuse_destroy(fuse);
+  free(opts.mountpoint);
   fuse_opt_free_args(&args);
   return ret;
 }
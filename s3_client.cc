@@ -0,0 +1,362 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#include "s3_client.h"
+#include "log.h"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include <aws/core/Aws.h>
+#include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/http/HttpResponse.h>
+#include <aws/s3/model/GetObjectRequest.h>
+#include <aws/s3/model/HeadObjectRequest.h>
+
+namespace {
+
+// Throttling, server errors and errors before getting a response such as
+// connection failures and timeouts are worth retrying.
+bool IsRetryable(const Aws::S3::S3Error &err) {
+  if (err.ShouldRetry()) {
+    return true;
+  }
+  using Aws::Http::HttpResponseCode;
+  const HttpResponseCode code = err.GetResponseCode();
+  return code == HttpResponseCode::REQUEST_NOT_MADE ||
+         code == HttpResponseCode::TOO_MANY_REQUESTS ||
+         static_cast<int>(code) >=
+             static_cast<int>(HttpResponseCode::INTERNAL_SERVER_ERROR);
+}
+
+int ToErrno(const Aws::S3::S3Error &err) {
+  switch (err.GetResponseCode()) {
+  case Aws::Http::HttpResponseCode::NOT_FOUND:
+    return -ENOENT;
+  case Aws::Http::HttpResponseCode::FORBIDDEN:
+    return -EACCES;
+  default:
+    return -EIO;
+  }
+}
+
+} // namespace
+
+size_t LatencyHistogram::BucketIndex(const uint64_t us) {
+  if (us < kSubBuckets) {
+    return us;
+  }
+  // The top kSubBits bits below the leading one select the sub bucket.
+  const int shift = std::bit_width(us) - 1 - kSubBits;
+  return std::min<size_t>((shift + 1) * kSubBuckets + (us >> shift) -
+                              kSubBuckets,
+                          kNumBuckets - 1);
+}
+
+std::pair<uint64_t, uint64_t> LatencyHistogram::BucketRange(const size_t i) {
+  if (i < kSubBuckets) {
+    return {i, 1};
+  }
+  const int shift = i / kSubBuckets - 1;
+  return {(kSubBuckets + i % kSubBuckets) << shift, uint64_t(1) << shift};
+}
+
+void LatencyHistogram::Record(const std::chrono::microseconds latency) {
+  const uint64_t us = std::max<int64_t>(latency.count(), 0);
+  buckets_[BucketIndex(us)]++;
+  count_++;
+}
+
+std::chrono::microseconds
+LatencyHistogram::Percentile(const double p) const {
+  const uint64_t count = count_;
+  if (count == 0) {
+    return std::chrono::microseconds(0);
+  }
+  const uint64_t target =
+      std::max<uint64_t>(1, static_cast<uint64_t>(count * p / 100));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    const uint64_t n = buckets_[i];
+    if (seen + n >= target && n > 0) {
+      // Assume latencies are spread evenly in the bucket.
+      const auto [low, width] = BucketRange(i);
+      return std::chrono::microseconds(low + width * (target - seen) / n);
+    }
+    seen += n;
+  }
+  const auto [low, width] = BucketRange(kNumBuckets - 1);
+  return std::chrono::microseconds(low + width);
+}
+
+std::string LatencyHistogram::ToString() const {
+  std::stringstream ss;
+  ss << "count=" << count() << " p50=" << Percentile(50).count()
+     << "us p90=" << Percentile(90).count()
+     << "us p99=" << Percentile(99).count()
+     << "us p999=" << Percentile(99.9).count() << "us";
+  return ss.str();
+}
+
+struct RetryingS3Client::Attempt {
+  // 0 or -errno.
+  int result = -EIO;
+  bool retryable = false;
+  std::vector<uint8_t> data;
+  std::string etag;
+};
+
+RetryingS3Client::RetryingS3Client(const std::string &endpoint,
+                                   const RetryOptions &options)
+    : options_(options) {
+  Aws::Client::ClientConfiguration config;
+  config.endpointOverride = endpoint;
+  config.connectTimeoutMs = options_.attempt_timeout.count();
+  config.requestTimeoutMs = options_.attempt_timeout.count();
+  // We retry by ourselves.
+  config.retryStrategy =
+      Aws::MakeShared<Aws::Client::DefaultRetryStrategy>("ros3fs", 0);
+  client_ = std::make_shared<Aws::S3::S3Client>(config);
+}
+
+size_t RetryingS3Client::SizeClass(const uint64_t size) {
+  constexpr uint64_t kSmallestClass = 64 << 10;
+  return std::min<size_t>(std::bit_width((size - 1) / kSmallestClass),
+                          kNumSizeClasses - 1);
+}
+
+bool RetryingS3Client::Backoff(
+    const int attempt, const std::chrono::steady_clock::time_point deadline) {
+  // Full jitter spreads retries of many threads failing at the same time.
+  thread_local std::mt19937_64 engine(std::random_device{}());
+  const int shift = std::min(attempt, 20);
+  const std::chrono::milliseconds cap = std::min(
+      options_.max_backoff, options_.initial_backoff * (int64_t(1) << shift));
+  const std::chrono::milliseconds sleep(
+      std::uniform_int_distribution<int64_t>(0, cap.count())(engine));
+  if (std::chrono::steady_clock::now() + sleep > deadline) {
+    return false;
+  }
+  std::this_thread::sleep_for(sleep);
+  return true;
+}
+
+Aws::S3::Model::ListObjectsOutcome RetryingS3Client::ListObjects(
+    const Aws::S3::Model::ListObjectsRequest &request) {
+  const auto deadline = std::chrono::steady_clock::now() + options_.deadline;
+  for (int attempt = 0;; attempt++) {
+    const auto start = std::chrono::steady_clock::now();
+    Aws::S3::Model::ListObjectsOutcome outcome = client_->ListObjects(request);
+    if (outcome.IsSuccess()) {
+      list_latency_.Record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - start));
+      return outcome;
+    }
+
+    const Aws::S3::S3Error &err = outcome.GetError();
+    LOG(WARNING) << "ListObjects failed: " << err.GetExceptionName() << ": "
+                 << err.GetMessage() << LOG_KEY(attempt);
+    if (!IsRetryable(err) || attempt + 1 >= options_.max_attempts ||
+        !Backoff(attempt, deadline)) {
+      failures_++;
+      return outcome;
+    }
+    retries_++;
+  }
+}
+
+int RetryingS3Client::HeadObject(const std::string &bucket_name,
+                                 const std::string &key, std::string *etag) {
+  Aws::S3::Model::HeadObjectRequest request;
+  request.SetBucket(bucket_name);
+  request.SetKey(key);
+
+  const auto deadline = std::chrono::steady_clock::now() + options_.deadline;
+  for (int attempt = 0;; attempt++) {
+    Aws::S3::Model::HeadObjectOutcome outcome = client_->HeadObject(request);
+    if (outcome.IsSuccess()) {
+      *etag = outcome.GetResult().GetETag();
+      return 0;
+    }
+
+    const Aws::S3::S3Error &err = outcome.GetError();
+    if (!IsRetryable(err) || attempt + 1 >= options_.max_attempts ||
+        !Backoff(attempt, deadline)) {
+      // A missing object is an answer rather than a failure.
+      if (ToErrno(err) != -ENOENT) {
+        LOG(WARNING) << "HeadObject failed: " << err.GetExceptionName()
+                     << ": " << err.GetMessage() << LOG_KEY(key);
+        failures_++;
+      }
+      return ToErrno(err);
+    }
+    retries_++;
+  }
+}
+
+RetryingS3Client::Attempt RetryingS3Client::GetRangeOnce(
+    const std::string &bucket_name, const std::string &key,
+    const uint64_t offset, const uint64_t size, const std::string &if_match,
+    const std::shared_ptr<std::atomic<bool>> &cancelled) {
+  Aws::S3::Model::GetObjectRequest request;
+  request.SetBucket(bucket_name);
+  request.SetKey(key);
+  request.SetRange("bytes=" + std::to_string(offset) + "-" +
+                   std::to_string(offset + size - 1));
+  if (!if_match.empty()) {
+    // S3 answers 412 Precondition Failed, which is not retried, when the
+    // object was overwritten.
+    request.SetIfMatch(if_match);
+  }
+  // Abort the transfer when the other hedged request wins.
+  request.SetContinueRequestHandler(
+      [cancelled](const Aws::Http::HttpRequest *) { return !*cancelled; });
+
+  Attempt attempt;
+  const auto start = std::chrono::steady_clock::now();
+  Aws::S3::Model::GetObjectOutcome outcome = client_->GetObject(request);
+  if (!outcome.IsSuccess()) {
+    const Aws::S3::S3Error &err = outcome.GetError();
+    LOG_IF(WARNING, !*cancelled)
+        << "GetObject failed: " << err.GetExceptionName() << ": "
+        << err.GetMessage() << LOG_KEY(key) << LOG_KEY(offset) << LOG_KEY(size);
+    attempt.result = ToErrno(err);
+    attempt.retryable = IsRetryable(err);
+    return attempt;
+  }
+
+  std::istream &body = outcome.GetResult().GetBody();
+  attempt.data.resize(size);
+  body.read(reinterpret_cast<char *>(attempt.data.data()), size);
+  if (static_cast<uint64_t>(body.gcount()) != size) {
+    LOG(WARNING) << "GetObject returned " << body.gcount() << " bytes"
+                 << LOG_KEY(key) << LOG_KEY(offset) << LOG_KEY(size);
+    attempt.retryable = true;
+    return attempt;
+  }
+  const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  get_latency_.Record(latency);
+  get_latency_by_size_[SizeClass(size)].Record(latency);
+  attempt.etag = outcome.GetResult().GetETag();
+  attempt.result = 0;
+  return attempt;
+}
+
+// Issues a second GET when the first one is slower than hedge_percentile of
+// past GETs in the same size class and returns the first successful one.
+RetryingS3Client::Attempt RetryingS3Client::GetRangeHedged(
+    const std::string &bucket_name, const std::string &key,
+    const uint64_t offset, const uint64_t size, const std::string &if_match) {
+  const auto cancelled = std::make_shared<std::atomic<bool>>(false);
+
+  // We need enough samples to tell what is slow.
+  constexpr uint64_t kMinSamples = 20;
+  const LatencyHistogram &latency = get_latency_by_size_[SizeClass(size)];
+  if (options_.hedge_percentile <= 0 || latency.count() < kMinSamples) {
+    return GetRangeOnce(bucket_name, key, offset, size, if_match, cancelled);
+  }
+  const std::chrono::microseconds threshold =
+      latency.Percentile(options_.hedge_percentile);
+
+  struct Race {
+    std::mutex mutex;
+    std::condition_variable cv;
+    int running = 0;
+    std::optional<Attempt> winner;
+    int winner_index = -1;
+    Attempt last_failure;
+  };
+  const auto race = std::make_shared<Race>();
+  const auto run = [this, race, cancelled, bucket_name, key, offset, size,
+                    if_match](const int index) {
+    Attempt attempt =
+        GetRangeOnce(bucket_name, key, offset, size, if_match, cancelled);
+    std::lock_guard<std::mutex> lock(race->mutex);
+    race->running--;
+    if (!race->winner.has_value()) {
+      if (attempt.result == 0) {
+        race->winner = std::move(attempt);
+        race->winner_index = index;
+        *cancelled = true;
+      } else {
+        race->last_failure = std::move(attempt);
+      }
+    }
+    race->cv.notify_all();
+  };
+
+  // Destructors of these futures wait for the cancelled loser.
+  std::vector<std::future<void>> requests;
+  std::unique_lock<std::mutex> lock(race->mutex);
+  race->running = 1;
+  requests.emplace_back(std::async(std::launch::async, run, 0));
+  if (!race->cv.wait_for(lock, threshold,
+                         [&] { return race->running == 0; })) {
+    VLOG(1) << "Hedge GetObject" << LOG_KEY(key) << LOG_KEY(offset)
+            << LOG_KEY(threshold.count());
+    hedges_++;
+    race->running++;
+    requests.emplace_back(std::async(std::launch::async, run, 1));
+  }
+  race->cv.wait(lock, [&] {
+    return race->winner.has_value() || race->running == 0;
+  });
+
+  if (race->winner_index == 1) {
+    hedge_wins_++;
+  }
+  Attempt result = race->winner.has_value() ? std::move(*race->winner)
+                                            : std::move(race->last_failure);
+  *cancelled = true;
+  lock.unlock();
+  return result;
+}
+
+int RetryingS3Client::GetRange(const std::string &bucket_name,
+                               const std::string &key, const uint64_t offset,
+                               const uint64_t size,
+                               std::vector<uint8_t> *data, std::string *etag) {
+  data->clear();
+  if (size == 0) {
+    return 0;
+  }
+
+  const auto deadline = std::chrono::steady_clock::now() + options_.deadline;
+  for (int attempt = 0;; attempt++) {
+    Attempt a = GetRangeHedged(bucket_name, key, offset, size, *etag);
+    if (a.result == 0) {
+      *data = std::move(a.data);
+      if (etag->empty()) {
+        *etag = std::move(a.etag);
+      }
+      return 0;
+    }
+    if (!a.retryable || attempt + 1 >= options_.max_attempts ||
+        !Backoff(attempt, deadline)) {
+      failures_++;
+      LOG(ERROR) << "Give up GetObject after " << attempt + 1 << " attempts"
+                 << LOG_KEY(key) << LOG_KEY(offset) << LOG_KEY(size);
+      return a.result;
+    }
+    retries_++;
+  }
+}
+
+std::string RetryingS3Client::Stats() const {
+  std::stringstream ss;
+  ss << "get " << get_latency_.ToString() << std::endl
+     << "list " << list_latency_.ToString() << std::endl
+     << "retries=" << retries_ << " failures=" << failures_
+     << " hedges=" << hedges_ << " hedge_wins=" << hedge_wins_ << std::endl;
+  return ss.str();
+}
@@ -0,0 +1,119 @@
+// ros3fs: Read Only S3 File System
+// Copyright (C) 2023 Akira Kawata
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/ListObjectsRequest.h>
+
+// Latency histogram in microseconds. Each power of two is split into
+// kSubBuckets buckets, and percentiles are interpolated within a bucket, so
+// they are off by less than 1/kSubBuckets. Thread safe.
+class LatencyHistogram {
+public:
+  void Record(const std::chrono::microseconds latency);
+  // Returns the `p`-th percentile, or 0 when nothing is recorded.
+  std::chrono::microseconds Percentile(const double p) const;
+  uint64_t count() const { return count_; }
+  // Such as "count=100 p50=1024us p90=2048us p99=8192us p999=8192us".
+  std::string ToString() const;
+
+private:
+  static constexpr int kSubBits = 2;
+  static constexpr uint64_t kSubBuckets = 1 << kSubBits;
+  static constexpr size_t kNumBuckets = 40 * kSubBuckets;
+  static size_t BucketIndex(const uint64_t us);
+  // Returns the smallest latency in the `i`-th bucket and the width of it.
+  static std::pair<uint64_t, uint64_t> BucketRange(const size_t i);
+
+  std::array<std::atomic<uint64_t>, kNumBuckets> buckets_{};
+  std::atomic<uint64_t> count_ = 0;
+};
+
+struct RetryOptions {
+  // Including the first attempt.
+  int max_attempts = 5;
+  std::chrono::milliseconds initial_backoff{100};
+  std::chrono::milliseconds max_backoff{5000};
+  // Deadline of one request including all retries.
+  std::chrono::milliseconds deadline{60000};
+  // Timeout of connecting and of a transfer which stops making progress in
+  // one attempt. Must be shorter than deadline so that a stalled connection is
+  // retried.
+  std::chrono::milliseconds attempt_timeout{12000};
+  // Issue a duplicate GET when the first one takes longer than this
+  // percentile of past GETs of similar sizes, and cancel the slower one. 0
+  // disables hedging.
+  double hedge_percentile = 0;
+};
+
+// Wraps S3Client with retries of transient errors using jittered exponential
+// backoff, per-request deadlines and hedged GETs. Errors are returned instead
+// of aborting so that FUSE can report them as -EIO.
+//
+// All functions are thread safe.
+class RetryingS3Client {
+public:
+  RetryingS3Client(const std::string &endpoint, const RetryOptions &options);
+  RetryingS3Client(RetryingS3Client const &) = delete;
+  void operator=(RetryingS3Client const &) = delete;
+
+  // Returns the outcome of the last attempt.
+  Aws::S3::Model::ListObjectsOutcome
+  ListObjects(const Aws::S3::Model::ListObjectsRequest &request);
+  // Sets the ETag of `key` to `etag`. Returns 0 or -errno.
+  int HeadObject(const std::string &bucket_name, const std::string &key,
+                 std::string *etag);
+  // Reads [offset, offset + size) of `key` into `data`. Returns 0 or -errno.
+  // When `*etag` is not empty, the read fails with -EIO instead of mixing
+  // versions if `key` was overwritten since. Otherwise `*etag` is set to the
+  // ETag of the version read, so pass the same `etag` to all ranges of an
+  // object.
+  int GetRange(const std::string &bucket_name, const std::string &key,
+               const uint64_t offset, const uint64_t size,
+               std::vector<uint8_t> *data, std::string *etag);
+
+  // Latency histograms and counters of retries and hedges.
+  std::string Stats() const;
+
+private:
+  struct Attempt;
+
+  Attempt GetRangeOnce(const std::string &bucket_name, const std::string &key,
+                       const uint64_t offset, const uint64_t size,
+                       const std::string &if_match,
+                       const std::shared_ptr<std::atomic<bool>> &cancelled);
+  Attempt GetRangeHedged(const std::string &bucket_name,
+                         const std::string &key, const uint64_t offset,
+                         const uint64_t size, const std::string &if_match);
+  // Sleeps before the `attempt`-th retry. Returns false when the deadline
+  // passes before it.
+  bool Backoff(const int attempt,
+               const std::chrono::steady_clock::time_point deadline);
+
+  const RetryOptions options_;
+  std::shared_ptr<Aws::S3::S3Client> client_;
+
+  // GETs of sizes in (64 KiB << (i - 1), 64 KiB << i] are in the i-th size
+  // class, and the hedge threshold of a GET comes from its own class.
+  static constexpr size_t kNumSizeClasses = 12;
+  static size_t SizeClass(const uint64_t size);
+
+  LatencyHistogram get_latency_;
+  std::array<LatencyHistogram, kNumSizeClasses> get_latency_by_size_;
+  LatencyHistogram list_latency_;
+  std::atomic<uint64_t> retries_ = 0;
+  std::atomic<uint64_t> failures_ = 0;
+  std::atomic<uint64_t> hedges_ = 0;
+  std::atomic<uint64_t> hedge_wins_ = 0;
+};
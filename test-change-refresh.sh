@@ -0,0 +1,65 @@
+#! /bin/bash -u
+# Mounts ros3fs against fake-s3.py with change detectors and checks that new
+# objects appear after they are reported through the change log, the marker
+# object and /.ros3fs/refresh.
+
+cd $(git rev-parse --show-toplevel)
+cmake --build build || exit 1
+cd build
+exit_code=0
+PORT=19879
+
+ANSWER_DIR=$(mktemp -d)
+mkdir -p ${ANSWER_DIR}/bucket1/dir_a ${ANSWER_DIR}/bucket1/dir_b
+echo a > ${ANSWER_DIR}/bucket1/dir_a/testfile_a
+echo b > ${ANSWER_DIR}/bucket1/dir_b/testfile_b
+echo 1 > ${ANSWER_DIR}/bucket1/marker
+
+python3 ../fake-s3.py --root ${ANSWER_DIR} --port ${PORT} &
+FAKE_S3_PID=$!
+sleep 1
+
+export AWS_ACCESS_KEY_ID=hoge
+export AWS_SECRET_ACCESS_KEY=fuga
+export AWS_EC2_METADATA_DISABLED=true
+MOUNTPOINT=$(mktemp -d)
+CACHE_DIR=$(mktemp -d)
+CHANGE_LOG=$(mktemp)
+GLOG_logtostderr=1 ./ros3fs ${MOUNTPOINT} -f --endpoint=http://localhost:${PORT} --bucket_name=bucket1/ --cache_dir=${CACHE_DIR} --clear_cache --update_seconds=1 --change_log=${CHANGE_LOG} --marker_key=marker >& ros3fs_change_refresh.log &
+ROS3FS_PID=$!
+sleep 3
+
+function check_exists(){
+    if [[ ! -f ${MOUNTPOINT}/$1 ]]; then
+        echo "test failed: $1 does not appear"
+        exit_code=1
+    fi
+}
+
+echo "=========== change log test =========="
+echo c > ${ANSWER_DIR}/bucket1/dir_a/testfile_c
+echo dir_a/testfile_c >> ${CHANGE_LOG}
+sleep 3
+check_exists dir_a/testfile_c
+
+echo "=========== marker test =========="
+mkdir -p ${ANSWER_DIR}/bucket1/dir_c
+echo d > ${ANSWER_DIR}/bucket1/dir_c/testfile_d
+echo 2 > ${ANSWER_DIR}/bucket1/marker
+sleep 3
+check_exists dir_c/testfile_d
+
+echo "=========== refresh test =========="
+rm ${ANSWER_DIR}/bucket1/dir_b/testfile_b
+cat ${MOUNTPOINT}/.ros3fs/refresh
+if [[ -e ${MOUNTPOINT}/dir_b ]]; then
+    echo "test failed: dir_b is not removed"
+    exit_code=1
+fi
+
+umount ${MOUNTPOINT}
+wait ${ROS3FS_PID}
+kill ${FAKE_S3_PID}
+rm -rf ${ANSWER_DIR} ${MOUNTPOINT} ${CACHE_DIR} ${CHANGE_LOG}
+
+exit ${exit_code}
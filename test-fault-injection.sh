@@ -0,0 +1,72 @@
+#! /bin/bash -u
+# Mounts ros3fs against fake-s3.py which fails, delays and drops requests at
+# random, and checks that reads still return the right contents. Then makes
+# every request fail and checks that reads fail with EIO instead of crashing
+# ros3fs.
+
+cd $(git rev-parse --show-toplevel)
+cmake --build build || exit 1
+cd build
+exit_code=0
+PORT=19878
+
+ANSWER_DIR=$(mktemp -d)
+mkdir -p ${ANSWER_DIR}/bucket1/dir_a/dir_a
+for f in testfile_a testfile_b testfile_c dir_a/testfile_a dir_a/dir_a/testfile_a
+do
+    echo ${RANDOM} > ${ANSWER_DIR}/bucket1/${f}
+    echo "aaaaaa" >> ${ANSWER_DIR}/bucket1/${f}
+done
+# Large enough to be downloaded in several ranges.
+head -c $((20 * 1024 * 1024)) /dev/urandom > ${ANSWER_DIR}/bucket1/large_file
+
+python3 ../fake-s3.py --root ${ANSWER_DIR} --port ${PORT} --error_rate=0.2 --delay_rate=0.05 --delay_ms=3000 --reset_rate=0.05 &
+FAKE_S3_PID=$!
+sleep 1
+
+export AWS_ACCESS_KEY_ID=hoge
+export AWS_SECRET_ACCESS_KEY=fuga
+export AWS_EC2_METADATA_DISABLED=true
+MOUNTPOINT=$(mktemp -d)
+CACHE_DIR=$(mktemp -d)
+GLOG_logtostderr=1 ./ros3fs ${MOUNTPOINT} -f --endpoint=http://localhost:${PORT} --bucket_name=bucket1/ --cache_dir=${CACHE_DIR} --clear_cache --no_pack --max_attempts=10 --range_mb=1 --hedge_percentile=90 >& ros3fs_fault_injection.log &
+ROS3FS_PID=$!
+sleep 3
+
+echo "=========== cat test with faults =========="
+for f in testfile_a testfile_b dir_a/testfile_a dir_a/dir_a/testfile_a large_file
+do
+    if ! cmp ${MOUNTPOINT}/${f} ${ANSWER_DIR}/bucket1/${f}; then
+        echo "test failed: ${f}"
+        exit_code=1
+    fi
+done
+cat ${MOUNTPOINT}/.ros3fs/stats
+
+echo "=========== EIO test =========="
+curl -s "http://localhost:${PORT}/_faults?error_rate=1.0&delay_rate=0&reset_rate=0"
+# The kernel may serve files read above from its page cache, so read a file
+# which was never read. Remove only cache files, which are sharded into
+# directories named by the first two hex digits of their keys.
+find ${CACHE_DIR} -mindepth 1 -maxdepth 1 -type d -name '??' -exec rm -rf {} +
+ROS3FS_TMPFILE=$(mktemp)
+cat ${MOUNTPOINT}/testfile_c >& ${ROS3FS_TMPFILE}
+if ! grep -q "Input/output error" ${ROS3FS_TMPFILE}; then
+    cat ${ROS3FS_TMPFILE}
+    echo "test failed: read did not fail with EIO"
+    exit_code=1
+fi
+if ! kill -0 ${ROS3FS_PID}; then
+    echo "test failed: ros3fs exited"
+    exit_code=1
+fi
+
+umount ${MOUNTPOINT}
+if ! wait ${ROS3FS_PID}; then
+    echo "test failed: ros3fs exited with an error"
+    exit_code=1
+fi
+kill ${FAKE_S3_PID}
+rm -rf ${ANSWER_DIR} ${MOUNTPOINT} ${CACHE_DIR} ${ROS3FS_TMPFILE}
+
+exit ${exit_code}
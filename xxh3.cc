@@ -0,0 +1,22 @@
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+#include <cstdint>
+#include <string>
+
+std::string GetXXH3(const std::string &str) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+
+  const XXH128_hash_t hash = XXH3_128bits(str.data(), str.size());
+  std::string result(32, '0');
+  for (int i = 0; i < 16; i++) {
+    result[15 - i] = kHexDigits[(hash.high64 >> (4 * i)) & 0xf];
+    result[31 - i] = kHexDigits[(hash.low64 >> (4 * i)) & 0xf];
+  }
+  return result;
+}
+
+std::pair<uint64_t, uint64_t> GetXXH3Bits(const std::string &str) {
+  const XXH128_hash_t hash = XXH3_128bits(str.data(), str.size());
+  return {hash.low64, hash.high64};
+}
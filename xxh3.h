@@ -0,0 +1,10 @@
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Returns the 128-bit XXH3 hash of str as 32 lowercase hex digits. Use this
+// instead of GetSHA256 where a cryptographic hash is not needed.
+std::string GetXXH3(const std::string &str);
+
+// Returns the 128-bit XXH3 hash of str as {low 64 bits, high 64 bits}.
+std::pair<uint64_t, uint64_t> GetXXH3Bits(const std::string &str);